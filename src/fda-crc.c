@@ -0,0 +1,315 @@
+/**
+ * fda-downloader - Simple reader for FlyDream Altimeter or Hobbyking Altimeter
+ *
+ * Copyright (C) 2017  OLopes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fda-downloader.h"
+#include "fda-pipeline.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <nmmintrin.h>
+#define FDA_CRC_SSE42 1
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define FDA_CRC_ARM 1
+#endif
+
+/* Castagnoli polynomial, reflected */
+#define FDA_CRC_POLY 0x82f63b78u
+
+/* slicing by 8 tables for the software path */
+static unsigned crc_table[8][256];
+static int crc_hw;
+
+/**
+ * Build tables and probe the CPU. Runs before main() so worker threads
+ * never race on it.
+ */
+#if defined(__GNUC__)
+__attribute__((constructor))
+#endif
+static void crc_init(void) {
+	unsigned c;
+	int i, j;
+	for(i = 0; i < 256; i++) {
+		c = i;
+		for(j = 0; j < 8; j++)
+			c = c & 1 ? (c >> 1) ^ FDA_CRC_POLY : c >> 1;
+		crc_table[0][i] = c;
+	}
+	for(i = 0; i < 256; i++) {
+		for(j = 1; j < 8; j++)
+			crc_table[j][i] = (crc_table[j-1][i] >> 8) ^ crc_table[0][crc_table[j-1][i] & 0xff];
+	}
+#if defined(FDA_CRC_SSE42)
+	crc_hw = __builtin_cpu_supports("sse4.2");
+#elif defined(FDA_CRC_ARM)
+	crc_hw = 1;
+#endif
+}
+
+static unsigned crc_sw(unsigned c, const unsigned char *p, size_t n) {
+	unsigned lo, hi;
+	for(; n >= 8; n -= 8, p += 8) {
+		lo = c ^ ((unsigned)p[0] | (unsigned)p[1] << 8 | (unsigned)p[2] << 16 | (unsigned)p[3] << 24);
+		hi = (unsigned)p[4] | (unsigned)p[5] << 8 | (unsigned)p[6] << 16 | (unsigned)p[7] << 24;
+		c = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff]
+			^ crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24]
+			^ crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff]
+			^ crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+	}
+	while(n--)
+		c = (c >> 8) ^ crc_table[0][(c ^ *p++) & 0xff];
+	return c;
+}
+
+#if defined(FDA_CRC_SSE42)
+__attribute__((target("sse4.2")))
+static unsigned crc_sse42(unsigned c, const unsigned char *p, size_t n) {
+#if defined(__x86_64__)
+	unsigned long long c64 = c, v;
+	for(; n >= 8; n -= 8, p += 8) {
+		memcpy(&v, p, 8);
+		c64 = _mm_crc32_u64(c64, v);
+	}
+	c = (unsigned)c64;
+#endif
+	while(n--)
+		c = _mm_crc32_u8(c, *p++);
+	return c;
+}
+#elif defined(FDA_CRC_ARM)
+static unsigned crc_arm(unsigned c, const unsigned char *p, size_t n) {
+	unsigned long long v;
+	for(; n >= 8; n -= 8, p += 8) {
+		memcpy(&v, p, 8);
+		c = __crc32cd(c, v);
+	}
+	while(n--)
+		c = __crc32cb(c, *p++);
+	return c;
+}
+#endif
+
+unsigned fda_crc32c(unsigned crc, const unsigned char *data, size_t size) {
+	unsigned c = ~crc;
+#if !defined(__GNUC__)
+	if(!crc_table[0][1])
+		crc_init();
+#endif
+#if defined(FDA_CRC_SSE42)
+	if(crc_hw)
+		return ~crc_sse42(c, data, size);
+#elif defined(FDA_CRC_ARM)
+	if(crc_hw)
+		return ~crc_arm(c, data, size);
+#endif
+	return ~crc_sw(c, data, size);
+}
+
+static int is_marker(const unsigned char *rec) {
+	return rec[0] == 0xff && rec[1] == 0xff && rec[2] == 0xff && rec[3] == 0xff;
+}
+
+/**
+ * Record checksum of bytes [start, end) as a session
+ */
+static int add_session(struct fda_crc *crc, int end) {
+	struct fda_crc_session *s;
+	if(crc->n == crc->cap) {
+		int cap = crc->cap ? crc->cap*2 : 16;
+		s = (struct fda_crc_session *) fda_realloc(crc->sessions, cap*sizeof(*s));
+		if(!s)
+			return -1;
+		crc->sessions = s;
+		crc->cap = cap;
+	}
+	s = &crc->sessions[crc->n++];
+	s->offset = crc->base+crc->start;
+	s->length = end-crc->start;
+	s->crc = crc->session;
+	return 0;
+}
+
+void fda_crc_start(struct fda_crc *crc) {
+	crc->file = 0;
+	crc->session = 0;
+	crc->pos = crc->base = 0;
+	crc->rec = crc->start = FDA_HEADER_SIZE+FDA_SAMPLE_SIZE;
+	crc->n = 0;
+}
+
+int fda_crc_feed(struct fda_crc *crc, const unsigned char *data, int size) {
+	int from;
+
+	if(size <= crc->pos)
+		return 0;
+	crc->file = fda_crc32c(crc->file, data+crc->pos, size-crc->pos);
+	crc->pos = size;
+
+	/* sessions end with a marker record, which belongs to them */
+	from = crc->rec;
+	for(; crc->rec+FDA_SAMPLE_SIZE <= size; crc->rec += FDA_SAMPLE_SIZE) {
+		if(!is_marker(data+crc->rec))
+			continue;
+		crc->session = fda_crc32c(crc->session, data+from, crc->rec+FDA_SAMPLE_SIZE-from);
+		/* a lone marker is not a session */
+		if(crc->rec > crc->start && add_session(crc, crc->rec+FDA_SAMPLE_SIZE))
+			return -1;
+		crc->session = 0;
+		crc->start = from = crc->rec+FDA_SAMPLE_SIZE;
+	}
+	if(crc->rec > from)
+		crc->session = fda_crc32c(crc->session, data+from, crc->rec-from);
+	return 0;
+}
+
+int fda_crc_finish(struct fda_crc *crc) {
+	/* session cut short by the end of data */
+	if(crc->rec > crc->start && add_session(crc, crc->rec))
+		return -1;
+	crc->start = crc->rec;
+	return 0;
+}
+
+void fda_crc_shift(struct fda_crc *crc, int n) {
+	crc->pos -= n;
+	crc->rec -= n;
+	crc->start -= n;
+	crc->base += n;
+}
+
+int fda_crc_compute(struct fda_crc *crc, const unsigned char *data, int size) {
+	fda_crc_start(crc);
+	if(fda_crc_feed(crc, data, size))
+		return -1;
+	return fda_crc_finish(crc);
+}
+
+void fda_crc_free(struct fda_crc *crc) {
+	fda_free(crc->sessions);
+	crc->sessions = NULL;
+	crc->n = crc->cap = 0;
+}
+
+/**
+ * Sidecar file name: data file name plus FDA_CRC_EXT
+ */
+static int sidecar_name(char *name, size_t size, const char *file) {
+	return snprintf(name, size, "%s%s", file, FDA_CRC_EXT) >= size;
+}
+
+int fda_crc_save(const struct fda_crc *crc, const char *file) {
+	char name[FILENAME_MAX];
+	FILE *fdf;
+	int i, retval;
+
+	if(sidecar_name(name, sizeof(name), file))
+		return -1;
+	fdf = fopen(name, "w");
+	if(!fdf)
+		return -1;
+	fprintf(fdf, "crc32c %d %08x\n", crc->base+crc->pos, crc->file);
+	for(i = 0; i < crc->n; i++)
+		fprintf(fdf, "session %d %d %d %08x\n", i+1, crc->sessions[i].offset,
+				crc->sessions[i].length, crc->sessions[i].crc);
+	retval = ferror(fdf);
+	if(fclose(fdf))
+		retval = -1;
+	return retval ? -1 : 0;
+}
+
+/**
+ * Open the checksum file of 'file' and read its first line. Returns NULL
+ * and sets 'retval' as fda_crc_check() does if there is none or it's bad.
+ */
+static FILE *open_sidecar(const char *file, int *total, unsigned *expected, int *retval) {
+	char name[FILENAME_MAX], line[128];
+	FILE *fdf;
+
+	*retval = -1;
+	if(sidecar_name(name, sizeof(name), file))
+		return NULL;
+	fdf = fopen(name, "r");
+	if(!fdf) {
+		*retval = 1;
+		return NULL;
+	}
+	if(!fgets(line, sizeof(line), fdf) || sscanf(line, "crc32c %d %x", total, expected) != 2) {
+		print_msg("Invalid checksum file %s\n", name);
+		fclose(fdf);
+		return NULL;
+	}
+	return fdf;
+}
+
+int fda_crc_check(const char *file, const unsigned char *data, int size) {
+	char line[128];
+	unsigned expected;
+	int n, offset, length, total, retval;
+	FILE *fdf;
+
+	fdf = open_sidecar(file, &total, &expected, &retval);
+	if(!fdf)
+		return retval;
+	/* the whole file first, sessions only tell where the damage is */
+	if(total == size && fda_crc32c(0, data, size) == expected) {
+		fclose(fdf);
+		return 0;
+	}
+	print_msg("%s: %d bytes, %d expected\n", file, size, total);
+	while(fgets(line, sizeof(line), fdf)) {
+		if(sscanf(line, "session %d %d %d %x", &n, &offset, &length, &expected) != 4)
+			continue;
+		if(offset < 0 || length < 0 || offset+length > size
+				|| fda_crc32c(0, data+offset, length) != expected) {
+			print_msg("%s: session %d is damaged\n", file, n);
+		}
+	}
+	fclose(fdf);
+	return -2;
+}
+
+int fda_crc_match(const char *file, const struct fda_crc *crc) {
+	char line[128];
+	unsigned expected;
+	int n, offset, length, total, retval, i;
+	FILE *fdf;
+
+	fdf = open_sidecar(file, &total, &expected, &retval);
+	if(!fdf)
+		return retval;
+	if(total == crc->base+crc->pos && crc->file == expected) {
+		fclose(fdf);
+		return 0;
+	}
+	print_msg("%s: %d bytes, %d expected\n", file, crc->base+crc->pos, total);
+	while(fgets(line, sizeof(line), fdf)) {
+		if(sscanf(line, "session %d %d %d %x", &n, &offset, &length, &expected) != 4)
+			continue;
+		for(i = 0; i < crc->n; i++) {
+			if(crc->sessions[i].offset == offset && crc->sessions[i].length == length)
+				break;
+		}
+		if(i == crc->n || crc->sessions[i].crc != expected)
+			print_msg("%s: session %d is damaged\n", file, n);
+	}
+	fclose(fdf);
+	return -2;
+}
@@ -0,0 +1,101 @@
+/**
+ * fda-downloader - Simple reader for FlyDream Altimeter or Hobbyking Altimeter
+ *
+ * Copyright (C) 2017  OLopes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "fda-downloader.h"
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+/* seconds to wait for udev to finish setting up a new device */
+#define FDA_DAEMON_SETTLE 1
+
+static volatile sig_atomic_t stop_daemon = 0;
+
+static void on_signal(int sig) {
+	stop_daemon = 1;
+}
+
+int fda_daemon_run(const char *dir, const char *pattern, fda_device_cb cb, void *ctx) {
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	char path[PATH_MAX];
+	const struct inotify_event *ev;
+	struct sigaction sa;
+	int fd, len, retval = 0;
+	char *p;
+
+	/* no SA_RESTART: a signal must interrupt the blocking read */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = &on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	fd = inotify_init1(IN_CLOEXEC);
+	if(fd == -1) {
+		perror("Error initializing inotify");
+		return -1;
+	}
+	/* device nodes are created, symlinks may also be moved in place */
+	if(inotify_add_watch(fd, dir, IN_CREATE | IN_MOVED_TO) == -1) {
+		perror("Error watching device directory");
+		close(fd);
+		return -2;
+	}
+	print_msg("Waiting for devices matching %s/%s\n", dir, pattern);
+	flush_msgs();
+
+	while(!stop_daemon && !retval) {
+		len = read(fd, buf, sizeof(buf));
+		if(len == -1) {
+			if(errno == EINTR)
+				continue;
+			perror("Error reading inotify events");
+			retval = -3;
+			break;
+		}
+		for(p = buf; p < buf+len && !retval && !stop_daemon; p += sizeof(struct inotify_event)+ev->len) {
+			ev = (const struct inotify_event *)p;
+			if(!ev->len || fnmatch(pattern, ev->name, 0))
+				continue;
+			snprintf(path, sizeof(path), "%s/%s", dir, ev->name);
+			print_msg("New device %s\n", path);
+			sleep(FDA_DAEMON_SETTLE);
+			retval = (*cb)(ctx, path);
+		}
+	}
+
+	print_msg("Daemon stopped\n");
+	close(fd);
+	return retval;
+}
+
+#else
+
+int fda_daemon_run(const char *dir, const char *pattern, fda_device_cb cb, void *ctx) {
+	print_msg("Daemon mode not supported on this platform\n");
+	return -1;
+}
+
+#endif
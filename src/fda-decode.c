@@ -0,0 +1,243 @@
+/**
+ * fda-downloader - Simple reader for FlyDream Altimeter or Hobbyking Altimeter
+ *
+ * Copyright (C) 2017  OLopes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "fda-downloader.h"
+#include "fda-pipeline.h"
+
+/* reference sea level pressure in Pa */
+static const double seaLevelPressure=101325;
+/* reference sea level temperature in K (15C) */
+static const double seaLevelTemperature=288.15;
+/* Specific gas constant for dry air in N.m/(mol.K) */
+static const double R=8.3144598;
+/* Gravitational acceleration in m/s2 */
+static const double g=9.80665;
+/* Molar mass of Earth's air in Kg/mol */
+static const double M=0.0289644;
+/* standard temperature lapse rate [K/m] = -0.0065 [K/m] */
+static const double L=-0.0065 ; // K/m
+
+/*
+ * fixed point altitude table: millimetres every 2^FDA_ALT_SHIFT Pa,
+ * calc_altitude(i << FDA_ALT_SHIFT) rounded. Precomputed, so neither
+ * startup nor the per sample path needs pow(); 'make check' verifies it.
+ */
+#define FDA_ALT_SHIFT 9
+#define FDA_ALT_STEPS 256
+static const long alt_table[FDA_ALT_STEPS+2] = {
+	44330769, 28121309, 25836190, 24352921, 23228928, 22313722, 21536556, 20858108,
+	20254108, 19708455, 19209881, 18750175, 18323155, 17924042, 17549063, 17195181,
+	16859915, 16541209, 16237339, 15946845, 15668479, 15401164, 15143966, 14896067,
+	14656747, 14425370, 14201369, 13984240, 13773528, 13568823, 13369757, 13175994,
+	12987227, 12803179, 12623592, 12448232, 12276884, 12109347, 11945438, 11784985,
+	11627830, 11473824, 11322830, 11174721, 11029374, 10886678, 10746527, 10608822,
+	10473469, 10340380, 10209473, 10080670, 9953895, 9829079, 9706156, 9585062,
+	9465738, 9348128, 9232176, 9117832, 9005047, 8893774, 8783968, 8675587,
+	8568590, 8462939, 8358595, 8255524, 8153691, 8053064, 7953610, 7855301,
+	7758106, 7661999, 7566951, 7472938, 7379935, 7287917, 7196862, 7106748,
+	7017552, 6929255, 6841835, 6755275, 6669556, 6584658, 6500566, 6417262,
+	6334729, 6252953, 6171917, 6091607, 6012008, 5933107, 5854890, 5777344,
+	5700456, 5624214, 5548605, 5473619, 5399244, 5325468, 5252282, 5179674,
+	5107635, 5036155, 4965224, 4894832, 4824971, 4755632, 4686807, 4618486,
+	4550661, 4483326, 4416471, 4350089, 4284173, 4218715, 4153709, 4089148,
+	4025024, 3961332, 3898064, 3835215, 3772779, 3710748, 3649119, 3587884,
+	3527038, 3466576, 3406492, 3346782, 3287439, 3228459, 3169838, 3111569,
+	3053649, 2996073, 2938836, 2881934, 2825362, 2769117, 2713193, 2657588,
+	2602297, 2547316, 2492641, 2438268, 2384194, 2330415, 2276928, 2223728,
+	2170813, 2118179, 2065823, 2013742, 1961932, 1910390, 1859113, 1808099,
+	1757343, 1706844, 1656598, 1606603, 1556855, 1507353, 1458092, 1409072,
+	1360288, 1311740, 1263423, 1215336, 1167476, 1119840, 1072427, 1025235,
+	978260, 931501, 884955, 838621, 792495, 746577, 700863, 655353,
+	610043, 564933, 520019, 475301, 430776, 386442, 342298, 298341,
+	254570, 210984, 167580, 124357, 81313, 38446, -4245, -46761,
+	-89105, -131278, -173281, -215116, -256785, -298288, -339628, -380806,
+	-421823, -462681, -503380, -543923, -584311, -624545, -664626, -704556,
+	-744335, -783966, -823449, -862786, -901978, -941025, -979930, -1018693,
+	-1057316, -1095799, -1134144, -1172352, -1210424, -1248361, -1286164, -1323834,
+	-1361373, -1398780, -1436058, -1473207, -1510228, -1547122, -1583891, -1620535,
+	-1657054, -1693451, -1729726, -1765879, -1801912, -1837826, -1873622, -1909299,
+	-1944860, -1980305, -2015635, -2050851, -2085953, -2120943, -2155821, -2190587,
+	-2225244, -2259791
+};
+
+/**
+ * Hand the pending samples to the filter and to the output stage
+ */
+static int flush_block(struct fda_decoder *dec) {
+	struct fda_block *blk = &dec->blk;
+	int retval = 0;
+	if(blk->n > 0) {
+		if(dec->filter)
+			fda_filter_block(dec->filter, blk->altitude, blk->smooth, blk->n);
+		retval = (*dec->cb)(dec->ctx, FDA_SAMPLES, blk);
+		blk->n = 0;
+	}
+	return retval;
+}
+
+void fda_decode_start(struct fda_decoder *dec) {
+	struct fda_block *blk = &dec->blk;
+	blk->session = 0;
+	blk->freq = 0;
+	blk->closed = 0;
+	blk->n = 0;
+	dec->st = 1;
+	dec->ts = dec->tIncr = 0.0;
+	/* skip header and go straight to the first observation */
+	dec->pos = FDA_HEADER_SIZE+FDA_SAMPLE_SIZE;
+}
+
+int fda_decode_feed(struct fda_decoder *dec, const unsigned char *data, int size) {
+	static const unsigned char empty[FDA_SAMPLE_SIZE] = {0xff, 0xff, 0xff, 0xff};
+	struct fda_block *blk = &dec->blk;
+	const unsigned char *sample;
+	int n, i, retval;
+
+	n = dec->pos;
+	sample = data+n;
+	for(; n+FDA_SAMPLE_SIZE <= size; n+=FDA_SAMPLE_SIZE, sample+=FDA_SAMPLE_SIZE) {
+		if(!memcmp(sample, empty, FDA_SAMPLE_SIZE)) {
+			/* end of session marker. repeated markers are ignored */
+			if(!dec->st) {
+				if((retval = flush_block(dec)))
+					return retval;
+				blk->closed = 1;
+				if((retval = (*dec->cb)(dec->ctx, FDA_SESSION_END, blk)))
+					return retval;
+			}
+			dec->st = 1;
+		} else if(dec->st) {
+			/* first record of a session holds the sample rate */
+			dec->st = 0;
+			blk->session++;
+			if(sample[3] > FDA_MAX_RATE_SHIFT)
+				print_msg("Invalid sample rate in session %d header: 2^%d Hz\n", blk->session, sample[3]);
+			blk->freq = 1 << (sample[3] > FDA_MAX_RATE_SHIFT ? FDA_MAX_RATE_SHIFT : sample[3]);
+			blk->closed = 0;
+			dec->index = 0;
+			/* the fixed point path counts samples, no float time */
+			if(!dec->fixed) {
+				dec->ts = 0.0;
+				dec->tIncr = 1.0/(double)blk->freq;
+				if(dec->filter)
+					fda_filter_reset(dec->filter, dec->tIncr);
+			}
+			if((retval = (*dec->cb)(dec->ctx, FDA_SESSION_START, blk)))
+				return retval;
+		} else {
+			i = blk->n++;
+			blk->temperature[i] = sample[0];
+			blk->pressure[i] = (long)sample[1]<<16 | sample[2]<<8 | sample[3];
+			if(dec->fixed) {
+				blk->index[i] = dec->index++;
+				blk->altitude_cm[i] = fda_altitude_cm(blk->pressure[i]);
+			} else {
+				blk->ts[i] = dec->ts;
+				blk->altitude[i] = calc_altitude(blk->pressure[i], blk->temperature[i]);
+				dec->ts += dec->tIncr;
+			}
+			if(blk->n == FDA_BLOCK_SIZE && (retval = flush_block(dec)))
+				return retval;
+		}
+	}
+	dec->pos = n;
+
+	/* don't hold samples back, more data may take a while to arrive */
+	return flush_block(dec);
+}
+
+int fda_decode_finish(struct fda_decoder *dec) {
+	struct fda_block *blk = &dec->blk;
+	int retval;
+	/* last session may not be terminated */
+	if(!dec->st) {
+		dec->st = 1;
+		if((retval = flush_block(dec)))
+			return retval;
+		blk->closed = 0;
+		return (*dec->cb)(dec->ctx, FDA_SESSION_END, blk);
+	}
+	return 0;
+}
+
+void fda_decode_shift(struct fda_decoder *dec, int n) {
+	dec->pos -= n;
+}
+
+int fda_decode(struct fda_decoder *dec, const unsigned char *data, int size) {
+	int retval;
+	fda_decode_start(dec);
+	if((retval = fda_decode_feed(dec, data, size)))
+		return retval;
+	return fda_decode_finish(dec);
+}
+
+int fda_valid_header(const unsigned char *header) {
+	/* ack byte followed by the upload command */
+	static const unsigned char signature[FDA_HEADER_SIZE] = {0x07, 0x0f, 0xda, 0x10, 0x00, 0xca, 0x00, 0x00};
+	return !memcmp(header, signature, FDA_HEADER_SIZE);
+}
+
+int fda_data_size(const unsigned char *header) {
+	int total;
+	total = header[9]-2; /* tricky one! */
+	total = total<<8 | header[10];
+	total = total<<8 | header[11];
+	/* add header size */
+	return total + FDA_HEADER_SIZE+FDA_SAMPLE_SIZE;
+}
+
+void fda_set_data_size(unsigned char *header, int total) {
+	total -= FDA_HEADER_SIZE+FDA_SAMPLE_SIZE;
+	header[9] = (total >> 16) + 2;
+	header[10] = (total >> 8) & 0xff;
+	header[11] = total & 0xff;
+}
+
+double calc_altitude(long pressure, short temp) {
+	const double hb = 0;
+	double h = hb + (seaLevelTemperature/L) * (pow(pressure/seaLevelPressure, (-R*L)/(g*M)) - 1.0);
+	// should consider M?
+	return h;
+}
+
+long long fda_altitude_frac(long pressure, long long *den) {
+	const long long step = 1 << FDA_ALT_SHIFT, scale = 2*step*step;
+	long long a, b, c, x;
+	long i = pressure >> FDA_ALT_SHIFT;
+
+	/* beyond the table: extrapolate the last segment */
+	if(i > FDA_ALT_STEPS-1)
+		i = FDA_ALT_STEPS-1;
+	a = alt_table[i];
+	b = alt_table[i+1];
+	c = alt_table[i+2];
+	x = pressure - i*step;
+	/* Newton forward differences over millimetres, scaled by 2*step^2 */
+	*den = 1000*scale;
+	return a*scale + x*(b-a)*2*step + x*(x-step)*(c-2*b+a);
+}
+
+long fda_altitude_cm(long pressure) {
+	long long den, num = fda_altitude_frac(pressure, &den)*100;
+	/* rounded half away from zero */
+	return (long)((num >= 0 ? num + den/2 : num - den/2) / den);
+}
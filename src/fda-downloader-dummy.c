@@ -20,40 +20,7 @@
 #include "fda-downloader.h"
 
 /* API FUNCTIONS */
+/* no serial port: devices are files (see fda-transport.c) */
 const char *TTY_DEVICE="sample.fda";
 
-int fda_init(struct fda_state* state) {
-	FILE *file;
-	file = fopen(state->tty_device, "rb");
-	if(!file) {
-		perror("failed to open file");
-		return 1;
-	}
-	state->handle = file;
-	return 0;
-}
-
-int fda_read(struct fda_state* state, unsigned char * buff, int n) {
-	FILE *file = (FILE*)state->handle;
-	int r;
-	r = fread(buff, sizeof(unsigned char), n, file);
-	if(r!=n && ferror(file)) {
-		/* error occurred */
-		return -1;
-	}
-	return r;
-}
-
-int fda_write(struct fda_state* state, const unsigned char * buff, int n) {
-	return n;
-}
-
-int fda_flush(struct fda_state* state) {
-	return 0;
-}
-
-int fda_close(struct fda_state* state) {
-	FILE *file = (FILE*)state->handle;
-	fclose(file);
-	return 0;
-}
+const struct fda_transport *const fda_serial_transport = NULL;
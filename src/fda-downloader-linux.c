@@ -101,11 +101,11 @@ struct fda_fd {
 	int fd;
 };
 
-int fda_init(struct fda_state* state) {
+static int serial_open(void **handle, const char *path) {
 	int fds;
 	struct fda_fd *ptr;
 	/* open and configure tty device */
-	fds = open(state->tty_device, O_RDWR | O_NOCTTY | O_NDELAY);
+	fds = open(path, O_RDWR | O_NOCTTY | O_NDELAY);
 	if(fds == -1) {
 		perror("Error opening tty device");
 		return -1;
@@ -119,10 +119,10 @@ int fda_init(struct fda_state* state) {
 	if(set_blocking (fds, 0))
 		return 5;
 
-	ptr =(struct fda_fd*) malloc(sizeof(struct fda_fd));
+	ptr =(struct fda_fd*) fda_malloc(sizeof(struct fda_fd));
 	ptr->fd=fds;
 
-	state->handle=(void*)ptr;
+	*handle=(void*)ptr;
 	return 0;
 }
 
@@ -149,8 +149,8 @@ static int _fda_do_select(int fd) {
 	return 0;
 }
 
-int fda_read(struct fda_state* state, unsigned char * buff, int n) {
-	struct fda_fd *ptr=(struct fda_fd *)state->handle;
+static int serial_read(void *handle, unsigned char * buff, int n) {
+	struct fda_fd *ptr=(struct fda_fd *)handle;
 	int r = -1, fds = ptr->fd;
 	if(_fda_do_select(fds))
 		return -8;
@@ -167,8 +167,8 @@ int fda_read(struct fda_state* state, unsigned char * buff, int n) {
 	return r;
 }
 
-int fda_flush(struct fda_state* state) {
-	struct fda_fd *ptr=(struct fda_fd *)state->handle;
+static int serial_flush(void *handle) {
+	struct fda_fd *ptr=(struct fda_fd *)handle;
 	int fds = ptr->fd;
 	print_msg("Waiting...\n");
 	/* wait for an answer... Actually I don't listen to any events. just flush buffers and wait a few millis. */
@@ -179,8 +179,8 @@ int fda_flush(struct fda_state* state) {
 	return 0;
 }
 
-int fda_write(struct fda_state* state, const unsigned char * buff, int n) {
-	struct fda_fd *ptr=(struct fda_fd *)state->handle;
+static int serial_write(void *handle, const unsigned char * buff, int n) {
+	struct fda_fd *ptr=(struct fda_fd *)handle;
 	int fds = ptr->fd;
 	int w = -1;
 	w = write(fds, buff, n);
@@ -191,11 +191,10 @@ int fda_write(struct fda_state* state, const unsigned char * buff, int n) {
 	return w;
 }
 
-int fda_close(struct fda_state*state) {
-	struct fda_fd *ptr=(struct fda_fd *)state->handle;
+static int serial_close(void *handle) {
+	struct fda_fd *ptr=(struct fda_fd *)handle;
 	int fds = ptr->fd;
-	free(ptr);
-	state->handle=NULL;
+	fda_free(ptr);
 
 	/* close the serial port */
 	if (close(fds) == -1) {
@@ -207,4 +206,8 @@ int fda_close(struct fda_state*state) {
 	return 0;
 }
 
+static const struct fda_transport serial_transport = {
+	"serial", &serial_open, &serial_read, &serial_write, &serial_flush, &serial_close
+};
 
+const struct fda_transport *const fda_serial_transport = &serial_transport;
@@ -26,13 +26,13 @@
 #define _DEV_NAME_SIZE 100
 
 const char *TTY_DEVICE="COM9";
-int fda_init(struct fda_state* state) {
+static int serial_open(void **handle, const char *path) {
 	HANDLE hComm;
 	DCB dcbSerialParams = {0};
 	COMMTIMEOUTS timeouts = {0};
 	char device [_DEV_NAME_SIZE];
 	memset(device, 0, sizeof(char)*_DEV_NAME_SIZE);
-	snprintf(device, _DEV_NAME_SIZE, "\\\\.\\%s", state->tty_device);
+	snprintf(device, _DEV_NAME_SIZE, "\\\\.\\%s", path);
 
 	print_msg("Opening COM port %s\n", device);
 	hComm = CreateFile(device,                /* port name               */
@@ -44,7 +44,7 @@ int fda_init(struct fda_state* state) {
 			NULL);                            /* Null for Comm Devices   */
 
 	if (hComm == INVALID_HANDLE_VALUE) {
-		print_msg("Error opening device %s\n", state->tty_device);
+		print_msg("Error opening device %s\n", path);
 		return 1;
 	}
 
@@ -103,13 +103,13 @@ int fda_init(struct fda_state* state) {
 	}
 
 
-	state->handle=(void*)malloc(sizeof(HANDLE));
-	memcpy(state->handle, &hComm, sizeof(HANDLE));
+	*handle=(void*)fda_malloc(sizeof(HANDLE));
+	memcpy(*handle, &hComm, sizeof(HANDLE));
 	return 0;
 }
 
-int fda_read(struct fda_state* state, unsigned char * buff, int n) {
-	HANDLE hComm = *((HANDLE*)state->handle);
+static int serial_read(void *handle, unsigned char * buff, int n) {
+	HANDLE hComm = *((HANDLE*)handle);
 	DWORD dwEventMask, lastErr, r;
 
 	/* wait for data to become available */
@@ -139,13 +139,13 @@ int fda_read(struct fda_state* state, unsigned char * buff, int n) {
 	return (int)r;
 }
 
-int fda_flush(struct fda_state* state) {
+static int serial_flush(void *handle) {
 	/* do nothing */
 	return 0;
 }
 
-int fda_write(struct fda_state* state, const unsigned char * buff, int n) {
-	HANDLE hComm = *((HANDLE*)state->handle);
+static int serial_write(void *handle, const unsigned char * buff, int n) {
+	HANDLE hComm = *((HANDLE*)handle);
 	DWORD bytes_written;
 
 	// Send specified text (remaining command line arguments)
@@ -160,9 +160,9 @@ int fda_write(struct fda_state* state, const unsigned char * buff, int n) {
 	return (int) bytes_written;
 }
 
-int fda_close(struct fda_state* state) {
-	HANDLE hComm = *((HANDLE*)state->handle);
-	free(state->handle);
+static int serial_close(void *handle) {
+	HANDLE hComm = *((HANDLE*)handle);
+	fda_free(handle);
 
 	// Close the Serial Port
 	if(CloseHandle(hComm)==0) {
@@ -173,3 +173,8 @@ int fda_close(struct fda_state* state) {
 	return 0;
 }
 
+static const struct fda_transport serial_transport = {
+	"serial", &serial_open, &serial_read, &serial_write, &serial_flush, &serial_close
+};
+
+const struct fda_transport *const fda_serial_transport = &serial_transport;
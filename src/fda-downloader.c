@@ -23,7 +23,9 @@
 #include <math.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <time.h>
 #include "fda-downloader.h"
+#include "fda-pipeline.h"
 
 // NOTE: Compile with -lm to include math functions
 
@@ -41,57 +43,159 @@ static void print_usage(const char *, ...);
 static int fda_send_cmd(struct fda_state* state);
 
 /**
- * Calculate altitude from pressure and temperature readings (hypsometric equation)
+ * Print received header
  */
-static double calc_altitude(long pressure, short temperature);
+static void print_data(unsigned char const * b, int size);
+
+#define FDA_MAX_OUTPUTS 8
 
 /**
- * Print received header
+ * Output file and its format
  */
-static void print_data(unsigned char const * b, int size);
+struct fda_output {
+	char format[8];     /* fda, dlm, ndjson or lod */
+	char delim[8];      /* own delimiter, from "fmt=delim:file" */
+	const char *dlm;
+	const char *file;
+};
 
 /**
- * Write contents to FDA/HKA file
+ * Upload settings, shared by single runs and daemon mode
  */
-static int save_fda(struct fda_state* state, const char *file, const char *);
+struct fda_job {
+	struct fda_output outputs[FDA_MAX_OUTPUTS];
+	int n_outputs;
+	int erase_after;
+	int split;          /* one set of outputs per session */
+	int workers;        /* threads converting sessions */
+	char scheme[16];    /* transport prefix of daemon devices, e.g. "pty:" */
+};
 
 /**
- * Write contents to CSV file
+ * Parse output specification "fmt[=delim]:file" and add it to 'job'
  */
-static int save_dlm(struct fda_state* state, const char *file, const char * dlm);
+static int add_output(struct fda_job *job, const char *spec, const char *dlm);
 
 /**
- * Release all allocated resources and closes TTY/COM device
+ * Outputs of one upload, written as its data is decoded
  */
-static int fda_dispose(struct fda_state* state);
+struct fda_sink {
+	struct fda_job *job;
+	struct fda_crc *crc;
+	struct fda_text_output text[FDA_MAX_OUTPUTS];
+	struct fda_fanout fanout;
+	struct fda_decoder dec;
+	struct fda_resampler rs;
+	struct fda_lod lod;
+	int lod_open;
+	int raw;            /* bytes of data already in 'fda' outputs */
+	int raw_files;      /* 'fda' outputs needing a checksum file */
+};
 
-/** UNIT CONVERSION FUNCTIONS */
+/**
+ * Open every output of 'job'. 'flt' and 'crc' hold the state of this
+ * upload only, 'crc' must be complete when the sink is closed.
+ */
+static int sink_open(struct fda_sink *sink, struct fda_job *job,
+		struct fda_filter *flt, struct fda_crc *crc);
+
+/**
+ * Write what was appended to 'data' since last call. Same calling
+ * convention as fda_decode_feed().
+ */
+static int sink_feed(struct fda_sink *sink, const unsigned char *data, int size);
+
+/**
+ * First 'n' bytes of data were dropped, see fda_decode_shift()
+ */
+static void sink_shift(struct fda_sink *sink, int n);
+
+/**
+ * Flush and close every output. Returns 'retval', the result so far,
+ * or the first error found while closing.
+ */
+static int sink_close(struct fda_sink *sink, int retval);
+
+/**
+ * Decode uploaded data once and write it to every output of 'job'.
+ * 'flt' and 'crc' hold the state of this call only.
+ */
+static int save_outputs(const unsigned char *data, int size, struct fda_job *job,
+		struct fda_filter *flt, struct fda_crc *crc);
+
+/**
+ * Write every session to its own outputs, in parallel, plus a manifest
+ */
+static int save_sessions(const unsigned char *data, int size, struct fda_job *job);
+
+/**
+ * Save uploaded data as 'job' says
+ */
+static int save_upload(struct fda_state* state, struct fda_job *job);
+
+/**
+ * Open device, send selected command, close device and save uploaded data
+ */
+static int fda_run(struct fda_state* state, struct fda_job *job);
+
+/**
+ * Erase altimeter contents after a successful upload
+ */
+static int fda_erase(struct fda_state* state);
 
 /**
- * Convert meters to feets
+ * Daemon callback: upload from a new device into a timestamped file
  */
-static double m_to_ft(double h);
+static int daemon_device(void *ctx, const char *device);
 
 /**
- * Convert degree Celsius to Fahrenheit
+ * Watch callback: convert a raw file sitting in the watched directory
  */
-static double c_to_F(double t);
+static int watch_file(void *ctx, const char *file);
 
 /**
- * Convert Pascal to PSI (Pound Square Inch)
+ * Check files against their checksum files, one line per file on stdout
  */
-static double pa_to_psi(double p);
+static int verify_files(struct fda_state* state, const char **files, int count);
 
 /**
- * Identity function: returns the same value as the parameter
+ * Receive the rest of an upload ('n' bytes of 'total' are in 'header')
+ * through a small window, writing the outputs of 'stream_job' meanwhile
  */
-static double identity(double i);
+static int stream_upload(struct fda_state* state, const unsigned char *header, int n, int total);
+
+/**
+ * Watch mode conversion through a small window: checksum pass first,
+ * then conversion pass. Same return values as watch_file().
+ */
+static int stream_file(struct fda_state* state, struct fda_job *job, const char *file, FILE *fdf, long size);
+
+/**
+ * fda_read() that waits for data, up to FDA_READ_TIMEOUT seconds of
+ * silence. Returns the bytes read, or < 0 on error or timeout.
+ */
+static int fda_read_wait(struct fda_state* state, unsigned char *buf, int n);
+
+/**
+ * Make room for 'size' bytes of uploaded data
+ */
+static int fda_reserve(struct fda_state* state, int size);
+
+/**
+ * Release all allocated resources and closes TTY/COM device
+ */
+static int fda_dispose(struct fda_state* state);
 
 #define FDA_BUF_SIZE 4096
-#define FDA_HEADER_SIZE 8
+/* window of streamed uploads, see --memory-limit */
+#define FDA_STREAM_SIZE (64*1024)
 #define FDA_CMD_SIZE 7
+/* seconds without data before a device is given up, see fda_read_wait() */
+#define FDA_READ_TIMEOUT 10
 #define FDA_FORMAT_FDA "fda"
 #define FDA_FORMAT_DLM "dlm"
+#define FDA_FORMAT_NDJSON "ndjson"
+#define FDA_FORMAT_LOD "lod"
 
 /* command list */
 /* upload altimeter contents */
@@ -110,23 +214,24 @@ static unsigned char const cmd_erased[FDA_CMD_SIZE] = {0x0f, 0xda, 0x10, 0x00, 0
 
 static int verbose = 0;
 
-/* reference sea level pressure in Pa */
-static const double seaLevelPressure=101325;
-/* reference sea level temperature in K (15C) */
-static const double seaLevelTemperature=288.15;
-/* Specific gas constant for dry air in N.m/(mol.K) */
-static const double R=8.3144598;
-/* Gravitational acceleration in m/s2 */
-static const double g=9.80665;
-/* Molar mass of Earth's air in Kg/mol */
-static const double M=0.0289644;
-/* standard temperature lapse rate [K/m] = -0.0065 [K/m] */
-static const double L=-0.0065 ; // K/m
-
-
-static double(*f_pressure)(double)     = &identity;
-static double(*f_temperature)(double)  = &identity;
-static double(*f_height)(double)       = &identity;
+/* optional altitude smoothing stage */
+static struct fda_filter smoother, *filter=NULL;
+/* optional live feed of samples received during upload */
+static struct fda_live live_feed;
+static struct fda_decoder live_decoder, *live=NULL;
+/* output sample rate, 0 to keep the recorded one */
+static int resample_rate = 0;
+/* integer only decoding and DLM formatting */
+static int fixed_point = 0;
+/* optional derived columns and row filter */
+static struct fda_query query, *query_p=NULL;
+/* checksums of the last upload, computed while it is received */
+static struct fda_crc checksum;
+/* --memory-limit: uploads are streamed to the outputs of 'stream_job' */
+static int streaming = 0;
+static struct fda_job *stream_job = NULL;
+
+static const struct fda_units *units = &fda_metric_units;
 
 /**
  * Entry point
@@ -135,13 +240,17 @@ int main(int argc, char** argv) {
 	/* getopt_long stores the option index here. */
 	int option_index = 0;
 	int c;
-	int retval;
+	int retval, daemon=0, workers=4, interpolate=0;
     struct fda_state state, *statep=&state;
-	const char *out_file=NULL, *dlm=NULL, *out_format=NULL, *cmd_param=NULL;
-	int (*f_save)(struct fda_state*,const char*, const char*)=NULL;
+    struct fda_job job;
+	const char *dlm=NULL, *out_format=NULL, *cmd_param=NULL, *live_name=NULL, *lod_file=NULL;
+	const char *extra_outputs[FDA_MAX_OUTPUTS];
+	int i, n_extra=0, n_lod;
+	const char *err;
 	
     /* prepare state */
     memset(statep, 0, sizeof(state));
+    memset(&job, 0, sizeof(job));
     state.tty_device=TTY_DEVICE;
 
     while(1) {
@@ -157,10 +266,30 @@ int main(int argc, char** argv) {
 			{"format",    required_argument, 0, 'f'},
 			{"delimiter", required_argument, 0, 'd'},
 			{"imperial" , no_argument,       0, 'i'},
+			{"smooth",    required_argument, 0, 'k'},
+			{"lod",       required_argument, 0, 'l'},
+			{"live",      required_argument, 0, 'L'},
+			{"daemon",    no_argument,       0, 'D'},
+			{"erase-after", no_argument,     0, 'E'},
+			{"server",    required_argument, 0, 'S'},
+			{"workers",   required_argument, 0, 'w'},
+			{"watch",     required_argument, 0, 'W'},
+			{"merge",     required_argument, 0, 'M'},
+			{"interpolate", no_argument,     0, 'I'},
+			{"io",        required_argument, 0, 'O'},
+			{"output",    required_argument, 0, 'o'},
+			{"verify",    required_argument, 0, 'V'},
+			{"aggregate", required_argument, 0, 'A'},
+			{"expr",      required_argument, 0, 'x'},
+			{"where",     required_argument, 0, 'q'},
+			{"fixed",     no_argument,       0, 'F'},
+			{"split-sessions", no_argument,  0, 'P'},
+			{"resample",  required_argument, 0, 'r'},
+			{"memory-limit", required_argument, 0, 'm'},
 			{0, 0, 0, 0}
     	};
 
-    	c = getopt_long (argc, argv, "u:es:t:vf:d:i", long_options, &option_index);
+    	c = getopt_long (argc, argv, "u:es:t:vf:d:ik:l:L:DES:w:W:M:IO:o:V:x:q:FPr:A:m:", long_options, &option_index);
 
     	/* Detect the end of the options. */
     	if (c == -1)
@@ -169,6 +298,11 @@ int main(int argc, char** argv) {
     	switch(c) {
     	case 'u':
     	case 's':
+    	case 'S':
+    	case 'W':
+    	case 'M':
+    	case 'V':
+    	case 'A':
     		cmd_param=optarg;
     		/* no break */
     	case 'e':
@@ -189,9 +323,76 @@ int main(int argc, char** argv) {
     		break;
 		case 'i':
 			/* use imperial units */
-			f_pressure     = &pa_to_psi;
-			f_temperature  = &c_to_F;
-			f_height       = &m_to_ft;
+			units = &fda_imperial_units;
+			break;
+		case 'k':
+			/* smooth altitude with a Kalman filter */
+			if(fda_filter_parse(&smoother, optarg)) {
+				print_usage("Invalid filter settings: %s\n", optarg);
+				return 16;
+			}
+			filter = &smoother;
+			break;
+		case 'l':
+			lod_file=optarg;
+			break;
+		case 'L':
+			live_name=optarg;
+			break;
+		case 'D':
+			daemon=1;
+			break;
+		case 'E':
+			job.erase_after=1;
+			break;
+		case 'w':
+			workers=atoi(optarg);
+			break;
+		case 'I':
+			interpolate=1;
+			break;
+		case 'O':
+			if(fda_output_io(optarg)) {
+				print_usage("Invalid output backend: %s\n", optarg);
+				return 18;
+			}
+			break;
+		case 'x':
+		case 'q':
+			/* compiled once, evaluated on every block */
+			if((c == 'x' ? fda_query_add(&query, optarg, &err) : fda_query_where(&query, optarg, &err))) {
+				print_usage("Invalid expression '%s': %s\n", optarg, err);
+				return 20;
+			}
+			query_p = &query;
+			break;
+		case 'F':
+			fixed_point=1;
+			break;
+		case 'P':
+			job.split=1;
+			break;
+		case 'r':
+			resample_rate=atoi(optarg);
+			if(resample_rate <= 0) {
+				print_usage("Invalid sample rate: %s\n", optarg);
+				return 21;
+			}
+			break;
+		case 'm':
+			if(fda_mem_limit(optarg)) {
+				print_usage("Invalid memory limit: %s\n", optarg);
+				return 22;
+			}
+			streaming=1;
+			break;
+		case 'o':
+			/* parsed once the default delimiter is known */
+			if(n_extra == FDA_MAX_OUTPUTS-2) {
+				print_usage("Too many outputs\n");
+				return 19;
+			}
+			extra_outputs[n_extra++]=optarg;
 			break;
 
     	case '?':
@@ -203,7 +404,9 @@ int main(int argc, char** argv) {
     	}
     }
 
-    if(state.cmd_set != 1 || optind < argc) {
+    if(state.cmd_set != 1 || (daemon && state.selected_cmd != 'u')
+    		|| (optind < argc && !strchr("MVA", state.selected_cmd))
+    		|| (optind == argc && (state.selected_cmd == 'M' || state.selected_cmd == 'A'))) {
     	print_usage(NULL);
     	return 1;
     }
@@ -212,24 +415,127 @@ int main(int argc, char** argv) {
 
     /* this could be better written, but I don't care. :-P */
 
+    /* conversion server doesn't talk to any device */
+    if(state.selected_cmd == 'S') {
+    	retval = fda_server_run(cmd_param, workers, filter);
+    	fda_mem_report("total");
+    	return retval;
+    }
+
+    /* merge files given as arguments, no device involved */
+    if(state.selected_cmd == 'M') {
+    	FILE *fdf = fda_open_output(cmd_param, "w");
+    	if(!fdf) {
+    		perror("Error opening output file");
+    		return 2;
+    	}
+    	retval = fda_merge(fdf, (const char **)argv+optind, argc-optind, dlm ? dlm : ",", units, interpolate);
+    	if(fda_close_output(fdf) && !retval)
+    		retval = 3;
+    	fda_mem_report("total");
+    	return retval;
+    }
+
+    /* fleet report over archived files, no device involved */
+    if(state.selected_cmd == 'A') {
+    	FILE *fdf = fda_open_output(cmd_param, "w");
+    	if(!fdf) {
+    		perror("Error opening output file");
+    		return 2;
+    	}
+    	retval = fda_fleet_run(fdf, (const char **)argv+optind, argc-optind, workers);
+    	if(fda_close_output(fdf) && !retval)
+    		retval = 3;
+    	fda_mem_report("total");
+    	return retval;
+    }
+
+    /* check archived files, no device involved */
+    if(state.selected_cmd == 'V') {
+    	argv[optind-1] = (char *)cmd_param;
+    	retval = verify_files(statep, (const char **)argv+optind-1, argc-optind+1);
+    	fda_dispose(statep);
+    	fda_mem_report("total");
+    	return retval;
+    }
+
+    /* watched files are already in FDA format, convert them to DLM */
+    if(state.selected_cmd == 'W') {
+    	if(out_format == NULL)
+    		out_format = FDA_FORMAT_DLM;
+    	if(strcmp(FDA_FORMAT_DLM,out_format) && strcmp(FDA_FORMAT_NDJSON,out_format)) {
+    		print_usage("Invalid file format for watch mode: %s\n", out_format);
+    		return 15;
+    	}
+    }
+
     /* decide what command should be sent to the altimeter */
     if(state.selected_cmd == 'e') {
     	state.tty_cmd=cmd_erased;
-    } else if(state.selected_cmd == 'u') {
+    } else if(state.selected_cmd == 'u' || state.selected_cmd == 'W') {
     	state.tty_cmd=cmd_upload;
-		out_file = cmd_param;
+		if(dlm == NULL) dlm=",";
 		// validate output format
 		if(out_format == NULL || !strcmp("fda",out_format) || !strcmp("hka",out_format)) {
-			f_save = &save_fda;
+			out_format = FDA_FORMAT_FDA;
 			print_msg("FDA output format selected\n");
-		} else if(!strcmp("dlm",out_format)) {
-			f_save=&save_dlm;
-			if(dlm == NULL) dlm=",";
+		} else if(!strcmp(FDA_FORMAT_DLM,out_format)) {
 			print_msg("DLM output format selected. Delimiter: '%s'\n", dlm);
+		} else if(!strcmp(FDA_FORMAT_NDJSON,out_format)) {
+			print_msg("NDJSON output format selected\n");
 		} else {
 			print_usage("Invalid file format: %s\n", out_format);
 			return 15;
 		}
+		/* main output first, then --output and --lod ones */
+		strcpy(job.outputs[0].format, out_format);
+		job.outputs[0].dlm = dlm;
+		job.outputs[0].file = cmd_param;
+		job.n_outputs = 1;
+		for(i = 0; i < n_extra; i++) {
+			if(add_output(&job, extra_outputs[i], dlm)) {
+				print_usage("Invalid output: %s\n", extra_outputs[i]);
+				return 15;
+			}
+		}
+		if(lod_file) {
+			if(job.n_outputs == FDA_MAX_OUTPUTS) {
+				print_usage("Too many outputs\n");
+				return 15;
+			}
+			strcpy(job.outputs[job.n_outputs].format, FDA_FORMAT_LOD);
+			job.outputs[job.n_outputs].dlm = dlm;
+			job.outputs[job.n_outputs].file = lod_file;
+			job.n_outputs++;
+		}
+		/* a single pyramid is built per run */
+		for(i = 0, n_lod = 0; i < job.n_outputs; i++)
+			n_lod += !strcmp(job.outputs[i].format, FDA_FORMAT_LOD);
+		if(n_lod > 1) {
+			print_usage("Only one 'lod' output can be written\n");
+			return 15;
+		}
+		job.workers = workers > 0 ? workers : 1;
+		/* every session gets its own file names */
+		for(i = 0; job.split && i < job.n_outputs; i++) {
+			if(!strcmp(job.outputs[i].file, "-")) {
+				print_usage("--split-sessions needs output files\n");
+				return 15;
+			}
+		}
+		/* the fixed point path only has a DLM writer and no filters */
+		if(fixed_point) {
+			if(filter || query_p || resample_rate) {
+				print_usage("--fixed can't be used with --smooth, --expr, --where or --resample\n");
+				return 15;
+			}
+			for(i = 0; i < job.n_outputs; i++) {
+				if(strcmp(job.outputs[i].format, FDA_FORMAT_DLM) && strcmp(job.outputs[i].format, FDA_FORMAT_FDA)) {
+					print_usage("--fixed only writes 'dlm' and 'fda' files\n");
+					return 15;
+				}
+			}
+		}
     } else if(state.selected_cmd == 's') {
 		if(!strcmp("1",cmd_param)) {
 			state.tty_cmd=cmd_set1hz;
@@ -244,34 +550,219 @@ int main(int argc, char** argv) {
 		}
 	}
 
+    if(live_name && state.selected_cmd == 'u') {
+    	if(fda_live_open(&live_feed, live_name)) {
+    		print_msg("Error creating live feed %s\n", live_name);
+    	} else {
+    		live_decoder.filter = NULL;
+    		live_decoder.cb = &fda_live_block;
+    		live_decoder.ctx = &live_feed;
+    		live = &live_decoder;
+    	}
+    }
+
+    if(state.selected_cmd == 'W') {
+    	void *ctx[2];
+    	ctx[0] = statep;
+    	ctx[1] = &job;
+    	retval = fda_watch_run(cmd_param, &watch_file, ctx);
+    } else if(daemon) {
+    	/* --tty is a pattern: watch its directory for matching devices */
+    	char dir[FILENAME_MAX], *pattern;
+    	const char *path;
+    	void *ctx[2];
+    	if(!fda_transport_find(state.tty_device, &path) || path-state.tty_device >= sizeof(job.scheme)) {
+    		print_usage("Unsupported device: %s\n", state.tty_device);
+    		return 17;
+    	}
+    	memcpy(job.scheme, state.tty_device, path-state.tty_device);
+    	strncpy(dir, path, sizeof(dir)-1);
+    	dir[sizeof(dir)-1] = '\0';
+    	pattern = strrchr(dir, '/');
+    	if(pattern == NULL) {
+    		print_usage("Device pattern must include a directory: %s\n", state.tty_device);
+    		return 17;
+    	}
+    	*pattern++ = '\0';
+    	ctx[0] = statep;
+    	ctx[1] = &job;
+    	retval = fda_daemon_run(*dir ? dir : "/", pattern, &daemon_device, ctx);
+    } else {
+    	retval = fda_run(statep, &job);
+    }
+
+    if(live)
+    	fda_live_close(&live_feed);
+    fda_dispose(statep);
+    fda_mem_report("total");
+    if(retval)
+    	return retval;
+    print_msg("Done!\n");
+
+	return 0;
+}
+
+static int fda_run(struct fda_state* state, struct fda_job *job) {
+	int retval, sent;
+
     // initialize device
-    retval=fda_init(statep);
+    retval=fda_init(state);
     if(retval) {
     	// use perror?
     	print_msg("Error initializing device\n");
     	return retval;
     }
 
-
-    retval = fda_send_cmd(statep);
-    if(retval) {
+    /* the whole upload is needed to split it */
+    stream_job = streaming && !job->split ? job : NULL;
+    sent = fda_send_cmd(state);
+    if(sent) {
     	// use perror?
     	print_msg("Error sending command to device\n");
     }
-    retval = fda_close(statep);
+    retval = fda_close(state);
     if(retval) {
     	// use perror?
     	print_msg("Error closing device\n");
     	return retval;
     }
 
-    if(state.selected_cmd == 'u' && state.data_size > 0) {
-    	retval = (*f_save)(statep, out_file, dlm);
+    if(state->selected_cmd == 'u' && state->data_size > 0) {
+    	/* streamed uploads are on disk already, with the same error code */
+    	retval = stream_job ? sent : save_upload(state, job) ? 14 : 0;
+    	/* only wipe the altimeter once its contents are safe on disk */
+    	if(job->erase_after && !sent && !retval)
+    		retval = fda_erase(state);
     }
 
-    retval = fda_dispose(statep);
-    print_msg("Done!\n");
+	return sent ? sent : retval;
+}
+
+static int fda_erase(struct fda_state* state) {
+	const unsigned char *tty_cmd = state->tty_cmd;
+	char selected_cmd = state->selected_cmd;
+	int retval, closed;
+
+	print_msg("Erasing %s\n", state->tty_device);
+	state->tty_cmd = cmd_erased;
+	state->selected_cmd = 'e';
+	retval = fda_init(state);
+	if(!retval) {
+		retval = fda_send_cmd(state);
+		closed = fda_close(state);
+		if(!retval)
+			retval = closed;
+	}
+	state->tty_cmd = tty_cmd;
+	state->selected_cmd = selected_cmd;
+	if(retval)
+		print_msg("Error erasing device\n");
+	return retval;
+}
+
+/**
+ * Expand strftime conversions in 'templ'. Without any, the timestamp is
+ * inserted before the file extension.
+ */
+static void timestamp_name(char *name, size_t size, const char *templ, const struct tm *tm) {
+	char stamp[32];
+	const char *ext;
+	if(strchr(templ, '%')) {
+		if(!strftime(name, size, templ, tm))
+			snprintf(name, size, "%s", templ);
+		return;
+	}
+	strftime(stamp, sizeof(stamp), "-%Y%m%d-%H%M%S", tm);
+	ext = strrchr(templ, '.');
+	if(!ext || strchr(ext, '/'))
+		ext = templ+strlen(templ);
+	snprintf(name, size, "%.*s%s%s", (int)(ext-templ), templ, stamp, ext);
+}
 
+static int watch_file(void *ctx, const char *file) {
+	struct fda_state *state = (struct fda_state *)((void**)ctx)[0];
+	struct fda_job job = *(struct fda_job *)((void**)ctx)[1];
+	char out_file[FILENAME_MAX];
+	const char *ext;
+	long size;
+	int total, retval;
+	FILE *fdf;
+
+	fdf = fopen(file, "rb");
+	if(!fdf) {
+		perror("Error opening input file");
+		return -1;
+	}
+	/* large reads straight into our buffer */
+	setvbuf(fdf, NULL, _IONBF, 0);
+	fseek(fdf, 0, SEEK_END);
+	size = ftell(fdf);
+	rewind(fdf);
+
+	/* only the main output, named after the input */
+	ext = strrchr(file, '.');
+	snprintf(out_file, sizeof(out_file), "%.*s.%s", (int)(ext-file), file,
+		strcmp(job.outputs[0].format, FDA_FORMAT_DLM) ? job.outputs[0].format : "csv");
+	job.outputs[0].file = out_file;
+	job.n_outputs = 1;
+
+	if(streaming && size >= FDA_HEADER_SIZE+FDA_SAMPLE_SIZE) {
+		print_msg("Converting %s into %s\n", file, out_file);
+		retval = stream_file(state, &job, file, fdf, size);
+		fclose(fdf);
+		fda_mem_report(file);
+		return retval;
+	}
+	if(size < FDA_HEADER_SIZE+FDA_SAMPLE_SIZE || fda_reserve(state, size)
+			|| fread(state->data, 1, size, fdf) != size) {
+		fclose(fdf);
+		return 1;
+	}
+	fclose(fdf);
+
+	if(state->data[0]!=0x07 || memcmp(state->data+1, cmd_upload, FDA_CMD_SIZE)) {
+		print_msg("Invalid signature header found in %s\n", file);
+		return -2;
+	}
+	/* still being written? */
+	total = fda_data_size(state->data);
+	if(size < total)
+		return 1;
+	state->data_size = total;
+	if(fda_crc_check(file, state->data, size) < 0) {
+		print_msg("Checksum mismatch in %s\n", file);
+		return -4;
+	}
+
+	print_msg("Converting %s into %s\n", file, out_file);
+	retval = save_upload(state, &job) ? -3 : 0;
+	fda_mem_report(file);
+	return retval;
+}
+
+static int daemon_device(void *ctx, const char *device) {
+	struct fda_state *state = (struct fda_state *)((void**)ctx)[0];
+	struct fda_job job = *(struct fda_job *)((void**)ctx)[1];
+	char files[FDA_MAX_OUTPUTS][FILENAME_MAX], uri[FILENAME_MAX];
+	time_t now = time(NULL);
+	struct tm *tm = localtime(&now);
+	int i;
+
+	for(i = 0; i < job.n_outputs; i++) {
+		timestamp_name(files[i], sizeof(files[i]), job.outputs[i].file, tm);
+		job.outputs[i].file = files[i];
+	}
+
+	/* same transport as the --tty pattern */
+	snprintf(uri, sizeof(uri), "%s%s", job.scheme, device);
+	state->tty_device = uri;
+	print_msg("Uploading %s into %s\n", uri, files[0]);
+	if(fda_run(state, &job))
+		print_msg("Upload from %s failed\n", device);
+	flush_msgs();
+	/* the upload buffer is kept for the next device */
+	state->data_size = 0;
+	fda_mem_report(device);
 	return 0;
 }
 
@@ -286,26 +777,78 @@ void print_usage(const char * err_msg, ...) {
     /* print usage */
     printf("Usage: fda-downloader [OPTIONS] <cmd>\n");
     printf("<cmd> is one of:\n");
-    printf("    -u, --upload <file>     Retrieve contents from altimeter\n");
+    printf("    -u, --upload <file>     Retrieve contents from altimeter. '-' is stdout\n");
     printf("    -e, --erase             Erase altimeter contents\n");
     printf("    -s, --setup <rate>      Set altimeter sample rate in Hz.\n");
     printf("                            Possible values are: 1, 2, 4 or 8\n");
+    printf("    -S, --server <socket>   Serve conversion requests on a Unix socket\n");
+    printf("    -W, --watch <dir>       Convert .fda/.hka files as they show up in <dir>\n");
+    printf("    -M, --merge <file> <input>...\n");
+    printf("                            Merge several FDA/HKA files into one table\n");
+    printf("    -V, --verify <file>...  Check FDA/HKA files against their %s checksums\n", FDA_CRC_EXT);
+    printf("                            Exits with 23 on a mismatch, 24 if a file\n");
+    printf("                            can't be read, 25 if its checksum file is\n");
+    printf("                            missing or invalid\n");
+    printf("    -A, --aggregate <report> <input>...\n");
+    printf("                            Write apex, duration and temperature\n");
+    printf("                            statistics of all sessions as JSON\n");
     printf("Options are:\n");
-    printf("    -f, --format <fmt>      Set output format. Can be either 'fda' or 'dlm'\n");
+    printf("    -f, --format <fmt>      Set output format. Can be 'fda', 'dlm' or 'ndjson'\n");
+    printf("    -o, --output <fmt[=delim]:file>\n");
+    printf("                            Also write <file> in <fmt> ('fda', 'dlm',\n");
+    printf("                            'ndjson' or 'lod'). Can be repeated.\n");
     printf("    -d, --delimiter <delim> Use <delim> as delimiter for 'dlm' files.\n");
-    printf("    -t, --tty <device>      Serial device to use.\n");
+    printf("    -i, --imperial          Use imperial units in 'dlm' files.\n");
+    printf("    -k, --smooth <q[:r]>    Add a smoothed altitude column to 'dlm' files.\n");
+    printf("                            q: process noise, r: measurement noise\n");
+    printf("    -x, --expr <name=expr>  Add column <name> to 'dlm' and 'ndjson' files.\n");
+    printf("                            Can be repeated. Variables: time, pressure,\n");
+    printf("                            temperature, altitude, smooth, vspeed,\n");
+    printf("                            launch, session, rate\n");
+    printf("    -q, --where <expr>      Only write samples where <expr> is not zero\n");
+    printf("                            Can be repeated, all of them must hold\n");
+    printf("    -F, --fixed             Decode and write 'dlm' files with integer\n");
+    printf("                            arithmetic only (altitude within 1 cm)\n");
+    printf("    -r, --resample <Hz>     Convert sessions to <Hz> samples per second,\n");
+    printf("                            low pass filtered when decimating\n");
+    printf("    -P, --split-sessions    Write every session to its own files\n");
+    printf("                            (<file>.NNN.<ext>), converted by --workers\n");
+    printf("                            threads, and list them in <file>.manifest.json\n");
+    printf("    -l, --lod <file>        Also write min/max/mean altitude and pressure\n");
+    printf("                            per session at power of two zoom levels,\n");
+    printf("                            one <file>.L<k> per level, indexed in <file>\n");
+    printf("    -L, --live <name>       Publish samples to shared memory <name> during\n");
+    printf("                            upload (e.g. /fda-live)\n");
+    printf("    -D, --daemon            Wait for devices matching --tty (wildcards\n");
+    printf("                            allowed) and upload each one into a\n");
+    printf("                            timestamped <file>\n");
+    printf("    -E, --erase-after       Erase altimeter after a successful upload\n");
+    printf("    -m, --memory-limit <n>  Use at most <n> bytes (K, M or G suffix).\n");
+    printf("                            Uploads and watched files are converted\n");
+    printf("                            through a %d KB window\n", FDA_STREAM_SIZE/1024);
+    printf("    -w, --workers <n>       Number of server, --split-sessions or\n");
+    printf("                            --aggregate worker threads (default 4)\n");
+    printf("    -I, --interpolate       Interpolate missing values when merging\n");
+    printf("    -O, --io <backend>      Output backend: auto, uring, thread or stdio\n");
+    printf("    -t, --tty <device>      Serial device to use. Can be prefixed by\n");
+    printf("                            'serial:', 'file:' (raw dump), 'replay:' or\n");
+    printf("                            'pty:' (altimeter emulated from a dump,\n");
+    printf("                            '<file>,<baud>' limits its speed).\n");
     printf("                            Defaults to %s\n", TTY_DEVICE);
     printf("    -v, --verbose           Enable verbose mode\n");
 }
 
 static void print_data(unsigned char const * buf, int size) {
-	int i;
-	char str[5*size+1], *p=str;
+	int i, j;
+	char str[5*16+1];
 	if(!verbose) return;
-	for(i = 0; i < size; i++)
-		p += sprintf(p, "0x%02x ", buf[i]);
-	str[5*size-1]='\0';
-	print_msg("%s\n",str);
+	/* 16 bytes per line */
+	for(i = 0; i < size; i += 16) {
+		for(j = 0; j < 16 && i+j < size; j++)
+			sprintf(str+5*j, "0x%02x ", buf[i+j]);
+		str[5*j-1]='\0';
+		print_msg("%s\n",str);
+	}
 }
 
 static int fda_send_cmd(struct fda_state* state) {
@@ -334,7 +877,7 @@ static int fda_send_cmd(struct fda_state* state) {
 	buf = b;
 	n = 0;
 	while (n < FDA_HEADER_SIZE) {
-		r = fda_read(state, buf+n, FDA_HEADER_SIZE - n);
+		r = fda_read_wait(state, buf+n, FDA_HEADER_SIZE - n);
 		if (r < 0) {
 			print_msg("Error reading %s\n", state->tty_device);
 			return 8;
@@ -360,14 +903,13 @@ static int fda_send_cmd(struct fda_state* state) {
 
 	// if upload contents was requested, continue to read altimeter data and output to file
 	state->data_size=0;
-	state->data=NULL;
 	if(state->selected_cmd == 'u') {
 
 		int upl_header_size=FDA_HEADER_SIZE+4; /* extra bytes for data size */
 		/* handle upload - send altimeter output to file */
 		/* n is not set to zero in order to keep upload header as one */
 		while (n < upl_header_size) {
-			r = fda_read(state, buf+n, 4);
+			r = fda_read_wait(state, buf+n, 4);
 			if (r < 0) {
 				print_msg("Error reading %s\n", state->tty_device);
 				return 11;
@@ -375,13 +917,7 @@ static int fda_send_cmd(struct fda_state* state) {
 			n+=r;
 		}
 
-		total = buf[9]-2; /* tricky one! */
-		total = total<<8 | buf[10];
-		total = total<<8 | buf[11];
-		/* add header size */
-		total += upl_header_size;
-
-		// total = ((buf[9]-2)*256 + buf[10])*256+buf[11]+upl_header_size;
+		total = fda_data_size(buf);
 		done=upl_header_size;
 		print_msg("total bytes: %d\n", total);
 		flush_msgs();
@@ -389,32 +925,47 @@ static int fda_send_cmd(struct fda_state* state) {
 		if(total <= done) {
 			print_msg("No data available, nothing to do!\n");
 			flush_msgs();
+		} else if(stream_job) {
+			return stream_upload(state, b, n, total);
 		} else {
 		
-			/* realloc buffer to hold all data */
-			buf = (unsigned char*) malloc(total*sizeof(unsigned char));
-			state->data = buf;
+			/* realloc buffer to hold all data. keep it between uploads */
+			if(fda_reserve(state, total))
+				return 13;
+			buf = state->data;
 			state->data_size=total;
 			/* copy bytes previously read */
 			memcpy(buf, b, sizeof(b));
 			buf += sizeof(b);
 			
+			/* checksum and publish samples as they arrive */
+			fda_crc_start(&checksum);
+			fda_crc_feed(&checksum, state->data, n);
+			if(live) {
+				fda_decode_start(live);
+				fda_decode_feed(live, state->data, n);
+			}
+
 			/* read remaining data */
 			while (n < total) {
-				r = fda_read(state, buf, FDA_BUF_SIZE);
+				r = fda_read_wait(state, buf, FDA_BUF_SIZE);
 				if (r < 0) {
 					print_msg("Error reading %s\n", state->tty_device);
 					return 12;
-				} else if (r == 0) {
-					/* no data, nothing to do, loop */
-					print_msg("no data...\n");
 				} else {
 					buf += r;
 					n += r;
-					printf("%d -> %u/%u (%u%%)\n", r, n,total,n*100/total);
-					fflush(stdout);
+					fda_crc_feed(&checksum, state->data, n);
+					if(live)
+						fda_decode_feed(live, state->data, n);
+					/* stdout may be carrying the output file */
+					fprintf(stderr, "%d -> %u/%u (%u%%)\n", r, n,total,n*100/total);
+					fflush(stderr);
 				}
 			}
+			fda_crc_finish(&checksum);
+			if(live)
+				fda_decode_finish(live);
 		}
 	}
 
@@ -436,140 +987,501 @@ void flush_msgs()  {
 }
 
 
-static int save_fda(struct fda_state* state, const char *file, const char *dlm) {
-	FILE *fdf;
-	int n, total, w;
-	unsigned char *buf;
-
-	if(state->data_size <= 0) {
-		print_msg("No data to write.\n");
-		return -1;
+static int add_output(struct fda_job *job, const char *spec, const char *dlm) {
+	struct fda_output *out = &job->outputs[job->n_outputs];
+	const char *sep = strchr(spec, ':'), *eq;
+	int len;
+
+	if(!sep || !sep[1] || job->n_outputs == FDA_MAX_OUTPUTS)
+		return 1;
+	eq = memchr(spec, '=', sep-spec);
+	len = (eq ? eq : sep) - spec;
+	if(len <= 0 || len >= sizeof(out->format))
+		return 2;
+	memcpy(out->format, spec, len);
+	out->format[len] = '\0';
+	if(!strcmp(out->format, "hka"))
+		strcpy(out->format, FDA_FORMAT_FDA);
+	if(strcmp(out->format, FDA_FORMAT_FDA) && strcmp(out->format, FDA_FORMAT_DLM)
+			&& strcmp(out->format, FDA_FORMAT_NDJSON) && strcmp(out->format, FDA_FORMAT_LOD))
+		return 3;
+	out->dlm = dlm;
+	if(eq) {
+		/* per output delimiter, kept in the output itself */
+		len = sep-eq-1;
+		if(len <= 0 || len >= sizeof(out->delim))
+			return 4;
+		memcpy(out->delim, eq+1, len);
+		out->delim[len] = '\0';
+		out->dlm = out->delim;
 	}
+	out->file = sep+1;
+	job->n_outputs++;
+	print_msg("%s output to %s\n", out->format, out->file);
+	return 0;
+}
 
-	fdf = fopen(file, "wb");
-	if(!fdf) {
-		perror("Error opening output file");
-		return -2;
-	}
+static int sink_open(struct fda_sink *sink, struct fda_job *job,
+		struct fda_filter *flt, struct fda_crc *crc) {
+	struct fda_text_output *text = sink->text;
+	struct fda_fanout *fanout = &sink->fanout;
+	struct fda_output *out;
+	int i, retval = 0;
+
+	memset(text, 0, sizeof(sink->text));
+	sink->job = job;
+	sink->crc = crc;
+	sink->lod_open = 0;
+	sink->raw = 0;
+	sink->raw_files = 0;
+	fanout->n = 0;
+	for(i = 0; i < job->n_outputs && !retval; i++) {
+		out = &job->outputs[i];
+		if(!strcmp(out->format, FDA_FORMAT_LOD)) {
+			/* one pyramid per run, main() rejects more. fda_lod_open() reports its errors */
+			if(sink->lod_open)
+				fprintf(stderr, "Only one LOD file can be written, %s refused\n", out->file);
+			if(sink->lod_open || fda_lod_open(&sink->lod, out->file, out->dlm)) {
+				retval = -2;
+				break;
+			}
+			sink->lod_open = 1;
+			sink->lod.units = units;
+			fanout->cb[fanout->n] = &fda_lod_block;
+			fanout->ctx[fanout->n++] = &sink->lod;
+			continue;
+		}
 
-	n = 0;
-	total = state->data_size;
-	buf = state->data;
-	while( n < total ) {
-		w = fwrite(buf+n, sizeof(unsigned char), total-n, fdf);
-		if(w < 0) {
-			print_msg("Error writing to file %s (%d)\n", file, w);
+		text[i].fdf = fda_open_output(out->file, strcmp(out->format, FDA_FORMAT_FDA) ? "w" : "wb");
+		if(!text[i].fdf) {
+			perror("Error opening output file");
+			retval = -2;
+			break;
+		}
+		print_msg("File \"%s\"open, start %s output\n", out->file, out->format);
+		if(!strcmp(out->format, FDA_FORMAT_FDA)) {
+			/* raw data, nothing to decode */
+			if(strcmp(out->file, "-"))
+				sink->raw_files++;
+			continue;
+		}
+		text[i].dlm = out->dlm;
+		text[i].units = units;
+		text[i].smooth = flt != NULL;
+		if(query_p && !(text[i].query = fda_query_open(query_p, units, flt != NULL))) {
+			retval = -2;
 			break;
 		}
-		/* update counters and pointers */
-		n += w;
+		if(!strcmp(out->format, FDA_FORMAT_NDJSON))
+			fanout->cb[fanout->n] = &fda_ndjson_block;
+		else
+			fanout->cb[fanout->n] = fixed_point ? &fda_dlm_fixed_block : &fda_dlm_block;
+		fanout->ctx[fanout->n++] = &text[i];
 	}
+	flush_msgs();
 
-	fflush(fdf);
-	
-	return fclose(fdf);
+	/* a single decoding pass feeds every output */
+	sink->dec.filter = flt;
+	sink->dec.fixed = fixed_point;
+	sink->dec.cb = &fda_fanout_block;
+	sink->dec.ctx = fanout;
+	/* resampler sits between the decoder and the outputs */
+	if(resample_rate) {
+		fda_resample_open(&sink->rs, resample_rate, flt != NULL, &fda_fanout_block, fanout);
+		sink->dec.cb = &fda_resample_block;
+		sink->dec.ctx = &sink->rs;
+	}
+	fda_decode_start(&sink->dec);
+	return retval;
 }
 
-#define FDA_SAMPLE_SIZE 4
-static int save_dlm(struct fda_state* state, const char *file, const char *dlm) {
-	FILE *fdf;
-	int n, st, freq, size;
-	unsigned char *sample, empty[FDA_SAMPLE_SIZE];
-	long pressure;
-	short temperature;
-	double altitude, ts, tIncr, press_conv, temp_conv, alti_conv;
-	memset(&empty, 0xff, sizeof(unsigned char)*FDA_SAMPLE_SIZE);
-
-	if(state->data_size <= 0) {
+static int sink_feed(struct fda_sink *sink, const unsigned char *data, int size) {
+	int i, retval = 0;
+
+	for(i = 0; i < sink->job->n_outputs && !retval; i++) {
+		if(sink->text[i].fdf && !strcmp(sink->job->outputs[i].format, FDA_FORMAT_FDA))
+			retval = fda_write_fda(sink->text[i].fdf, data+sink->raw, size-sink->raw);
+	}
+	sink->raw = size;
+	if(!retval && sink->fanout.n > 0) {
+		retval = fda_decode_feed(&sink->dec, data, size);
+		if(retval)
+			print_msg("Error writing outputs (%d)\n", retval);
+	}
+	return retval;
+}
+
+static void sink_shift(struct fda_sink *sink, int n) {
+	sink->raw -= n;
+	fda_decode_shift(&sink->dec, n);
+}
+
+static int sink_close(struct fda_sink *sink, int retval) {
+	struct fda_output *out;
+	int i;
+
+	if(!retval && sink->fanout.n > 0) {
+		retval = fda_decode_finish(&sink->dec);
+		if(retval)
+			print_msg("Error writing outputs (%d)\n", retval);
+	}
+	if(resample_rate)
+		fda_resample_close(&sink->rs);
+
+	for(i = 0; i < sink->job->n_outputs; i++) {
+		out = &sink->job->outputs[i];
+		if(!retval && sink->text[i].fdf && !strcmp(out->format, FDA_FORMAT_FDA) && strcmp(out->file, "-")
+				&& fda_crc_save(sink->crc, out->file))
+			print_msg("Error writing checksum of %s\n", out->file);
+		if(sink->text[i].fdf && fda_close_output(sink->text[i].fdf) && !retval)
+			retval = -3;
+		if(sink->text[i].query)
+			fda_query_close(sink->text[i].query);
+	}
+	if(sink->lod_open && fda_lod_close(&sink->lod) && !retval)
+		retval = -4;
+	print_msg("Output complete. Closing files...\n");
+	flush_msgs();
+	return retval;
+}
+
+static int save_outputs(const unsigned char *data, int size, struct fda_job *job,
+		struct fda_filter *flt, struct fda_crc *crc) {
+	struct fda_sink sink;
+	int retval;
+
+	if(size <= 0) {
 		print_msg("No data to write.\n");
 		return -1;
 	}
-	
-	fdf = fopen(file, "w");
+	retval = sink_open(&sink, job, flt, crc);
+	if(!retval)
+		retval = sink_feed(&sink, data, size);
+	/* not computed during transfer (e.g. watch mode) */
+	if(!retval && sink.raw_files && crc->pos != size)
+		fda_crc_compute(crc, data, size);
+	return sink_close(&sink, retval);
+}
+
+/**
+ * Insert ".NNN" before the extension of 'file'
+ */
+static void session_name(char *name, size_t size, const char *file, int session) {
+	const char *ext = strrchr(file, '.');
+	if(!ext || strchr(ext, '/'))
+		ext = file+strlen(file);
+	snprintf(name, size, "%.*s.%03d%s", (int)(ext-file), file, session, ext);
+}
+
+/**
+ * Sessions of one upload shared by the workers
+ */
+struct fda_split {
+	const unsigned char *data;
+	struct fda_job *job;
+	struct fda_crc sessions;
+};
+
+/**
+ * Worker task: session 'i' as an upload of its own
+ */
+static int save_session(void *ctx, int worker, int i) {
+	struct fda_split *split = (struct fda_split *)ctx;
+	const struct fda_crc_session *s = &split->sessions.sessions[i];
+	struct fda_job job = *split->job;
+	char files[FDA_MAX_OUTPUTS][FILENAME_MAX];
+	struct fda_filter flt;
+	struct fda_crc crc;
+	unsigned char *image;
+	int k, size, retval;
+
+	size = FDA_HEADER_SIZE+FDA_SAMPLE_SIZE+s->length;
+	image = (unsigned char *) fda_malloc(size);
+	if(!image)
+		return -5;
+	/* same upload header, announcing this session only */
+	memcpy(image, split->data, FDA_HEADER_SIZE+FDA_SAMPLE_SIZE);
+	fda_set_data_size(image, size);
+	memcpy(image+FDA_HEADER_SIZE+FDA_SAMPLE_SIZE, split->data+s->offset, s->length);
+
+	for(k = 0; k < job.n_outputs; k++) {
+		session_name(files[k], sizeof(files[k]), job.outputs[k].file, i+1);
+		job.outputs[k].file = files[k];
+	}
+	/* filter state is per session */
+	if(filter)
+		flt = *filter;
+	memset(&crc, 0, sizeof(crc));
+	retval = save_outputs(image, size, &job, filter ? &flt : NULL, &crc);
+	fda_crc_free(&crc);
+	fda_free(image);
+	return retval;
+}
+
+/**
+ * Write 's' as a JSON string
+ */
+static void json_string(FILE *fdf, const char *s) {
+	fputc('"', fdf);
+	for(; *s; s++) {
+		if(*s == '"' || *s == '\\')
+			fputc('\\', fdf);
+		if((unsigned char)*s < 0x20)
+			fprintf(fdf, "\\u%04x", *s);
+		else
+			fputc(*s, fdf);
+	}
+	fputc('"', fdf);
+}
+
+/**
+ * List sessions and their files, next to the main output
+ */
+static int write_manifest(struct fda_split *split) {
+	const struct fda_job *job = split->job;
+	const struct fda_crc_session *s;
+	char name[FILENAME_MAX], file[FILENAME_MAX];
+	const char *ext = strrchr(job->outputs[0].file, '.');
+	int i, k, closed, samples, rate;
+	FILE *fdf;
+
+	if(!ext || strchr(ext, '/'))
+		ext = job->outputs[0].file+strlen(job->outputs[0].file);
+	snprintf(name, sizeof(name), "%.*s.manifest.json", (int)(ext-job->outputs[0].file), job->outputs[0].file);
+	fdf = fopen(name, "w");
 	if(!fdf) {
-		perror("Error opening output file");
+		perror("Error opening manifest file");
 		return -2;
 	}
-	print_msg("File \"%s\"open, start data output with delimiter=%s\n", file, dlm);
-	flush_msgs();
-
-	/* skip header and go straight to the first observation */
-	/* reposition buffer to samples location */
-	st = 1;
-	size = state->data_size;
-	n = FDA_HEADER_SIZE+FDA_SAMPLE_SIZE;
-	sample = state->data+n;
-	for(; n < size; n+=FDA_SAMPLE_SIZE, sample+=FDA_SAMPLE_SIZE) {
-		if(!memcmp(sample, empty, sizeof(unsigned char)*FDA_SAMPLE_SIZE)) {
-			st++;
-			if(st < 2)
-				fprintf(fdf, "\n");
-			print_msg("Empty sample, output an empty line\n");
-		} else if(st) {
-			st = 0;
-			fprintf(fdf, "TIME%sPRESSURE%sTEMPERATURE%sALTITUDE\n",dlm,dlm,dlm);
-			freq = 1 << sample[3];
-			ts = 0.0;
-			tIncr = 1.0/(double)freq;
-			print_msg("First record, output header line. freq=%d; tIncr=%.3f\n", freq, tIncr);
-		} else {
-			temperature = sample[0];
-			pressure = sample[1];
-			pressure = pressure<<8 | sample[2];
-			pressure = pressure<<8 | sample[3];
-			altitude = calc_altitude(pressure, temperature);
-			
-			press_conv=(*f_pressure)(pressure);
-			temp_conv=(*f_temperature)(temperature);
-			alti_conv=(*f_height)(altitude);
-			fprintf(fdf, "%.3f%s%.2f%s%.2f%s%.2f\n",ts,dlm,press_conv,dlm,temp_conv,dlm,alti_conv);
-			
-			// debug message
-			print_msg("Regular record, output record line. ts=%.3f; pressure=%ld (%.2f) ; temperature=%hd (%.2f); altitude=%.2f (%.2f)\n",ts,pressure,press_conv,temperature,temp_conv,altitude,alti_conv);
-			
-			ts += tIncr;
+	fprintf(fdf, "{\"sessions\":[");
+	for(i = 0; i < split->sessions.n; i++) {
+		s = &split->sessions.sessions[i];
+		closed = !memcmp(split->data+s->offset+s->length-FDA_SAMPLE_SIZE, "\xff\xff\xff\xff", FDA_SAMPLE_SIZE);
+		samples = s->length/FDA_SAMPLE_SIZE - 1 - closed;
+		rate = split->data[s->offset+3];
+		rate = 1 << (rate > FDA_MAX_RATE_SHIFT ? FDA_MAX_RATE_SHIFT : rate);
+		fprintf(fdf, "%s\n{\"session\":%d,\"rate\":%d,\"samples\":%d,\"duration\":%.3f,\"closed\":%s,"
+				"\"offset\":%d,\"length\":%d,\"crc32c\":\"%08x\",\"files\":[",
+				i ? "," : "", i+1, rate, samples, (double)samples/rate, closed ? "true" : "false",
+				s->offset, s->length, s->crc);
+		for(k = 0; k < job->n_outputs; k++) {
+			session_name(file, sizeof(file), job->outputs[k].file, i+1);
+			fprintf(fdf, "%s{\"format\":\"%s\",\"file\":", k ? "," : "", job->outputs[k].format);
+			json_string(fdf, file);
+			fprintf(fdf, "}");
 		}
-		// flush_msgs();
+		fprintf(fdf, "]}");
 	}
-	
-	fflush(fdf);
+	fprintf(fdf, "\n]}\n");
+	if(fclose(fdf))
+		return -3;
+	print_msg("Manifest written to %s\n", name);
+	return 0;
+}
 
-	print_msg("Output complete. %d samples written. Closing file...\n", size);
-	flush_msgs();
-	return fclose(fdf);
+static int save_sessions(const unsigned char *data, int size, struct fda_job *job) {
+	struct fda_split split;
+	int retval;
 
+	split.data = data;
+	split.job = job;
+	memset(&split.sessions, 0, sizeof(split.sessions));
+	/* session boundaries, and their checksums for the manifest */
+	if(fda_crc_compute(&split.sessions, data, size))
+		return -5;
+	print_msg("%d sessions, %d workers\n", split.sessions.n, job->workers);
+	retval = fda_pool_run(job->workers, split.sessions.n, &save_session, &split);
+	if(!retval)
+		retval = write_manifest(&split);
+	fda_crc_free(&split.sessions);
+	return retval;
 }
 
-static int fda_dispose(struct fda_state* state) {
-	free(state->data);
-	state->data=NULL;
-	state->data_size=0;
-	return 0;
+static int save_upload(struct fda_state* state, struct fda_job *job) {
+	if(job->split)
+		return save_sessions(state->data, state->data_size, job);
+	return save_outputs(state->data, state->data_size, job, filter, &checksum);
 }
 
-double calc_altitude(long pressure, short temp) {
-	const double hb = 0;
-	double h = hb + (seaLevelTemperature/L) * (pow(pressure/seaLevelPressure, (-R*L)/(g*M)) - 1.0);
-	// should consider M?
-	return h;
+/**
+ * Drop the complete records every stage is done with from the window
+ */
+static int stream_shift(struct fda_state* state, int len, struct fda_sink *sink, struct fda_decoder *dec) {
+	int drop = len - len%FDA_SAMPLE_SIZE;
+	memmove(state->data, state->data+drop, len-drop);
+	fda_crc_shift(&checksum, drop);
+	if(sink)
+		sink_shift(sink, drop);
+	if(dec)
+		fda_decode_shift(dec, drop);
+	return len-drop;
+}
+
+static int stream_upload(struct fda_state* state, const unsigned char *header, int n, int total) {
+	struct fda_sink sink;
+	int r, len, retval;
+
+	if(fda_reserve(state, FDA_STREAM_SIZE))
+		return 13;
+	memcpy(state->data, header, n);
+	len = n;
+	state->data_size = total;
+
+	fda_crc_start(&checksum);
+	fda_crc_feed(&checksum, state->data, len);
+	if(live) {
+		fda_decode_start(live);
+		fda_decode_feed(live, state->data, len);
+	}
+	retval = sink_open(&sink, stream_job, filter, &checksum);
+	if(!retval)
+		retval = sink_feed(&sink, state->data, len);
+
+	while(!retval && n < total) {
+		if(len > FDA_STREAM_SIZE-FDA_BUF_SIZE)
+			len = stream_shift(state, len, &sink, live);
+		r = fda_read_wait(state, state->data+len, FDA_BUF_SIZE);
+		if (r < 0) {
+			print_msg("Error reading %s\n", state->tty_device);
+			retval = 12;
+		} else {
+			len += r;
+			n += r;
+			fda_crc_feed(&checksum, state->data, len);
+			if(live)
+				fda_decode_feed(live, state->data, len);
+			retval = sink_feed(&sink, state->data, len) ? 14 : 0;
+			fprintf(stderr, "%d -> %u/%u (%u%%)\n", r, n,total,n*100/total);
+			fflush(stderr);
+		}
+	}
+	fda_crc_finish(&checksum);
+	if(live)
+		fda_decode_finish(live);
+	if(sink_close(&sink, retval) && !retval)
+		retval = 14;
+	return retval;
 }
 
-static double identity(double h) {
-	return h;
+static int stream_file(struct fda_state* state, struct fda_job *job, const char *file, FILE *fdf, long size) {
+	struct fda_sink sink;
+	long n, end, want;
+	int r, len, pass, retval = 0;
+
+	if(fda_reserve(state, FDA_STREAM_SIZE)
+			|| fread(state->data, 1, FDA_HEADER_SIZE+FDA_SAMPLE_SIZE, fdf) != FDA_HEADER_SIZE+FDA_SAMPLE_SIZE)
+		return 1;
+	if(state->data[0]!=0x07 || memcmp(state->data+1, cmd_upload, FDA_CMD_SIZE)) {
+		print_msg("Invalid signature header found in %s\n", file);
+		return -2;
+	}
+	/* still being written? */
+	end = fda_data_size(state->data);
+	if(size < end)
+		return 1;
+
+	/* nothing is written from a damaged file */
+	for(pass = 0; pass < 2 && !retval; pass++) {
+		rewind(fdf);
+		fda_crc_start(&checksum);
+		if(pass)
+			retval = sink_open(&sink, job, filter, &checksum) ? -3 : 0;
+		/* checksum of the whole file, conversion of the upload in it */
+		want = pass ? end : size;
+		for(n = len = 0; !retval && n < want; n += r) {
+			if(len > FDA_STREAM_SIZE-FDA_BUF_SIZE)
+				len = stream_shift(state, len, pass ? &sink : NULL, NULL);
+			r = fread(state->data+len, 1, want-n < FDA_BUF_SIZE ? want-n : FDA_BUF_SIZE, fdf);
+			if(r <= 0) {
+				/* truncated meanwhile */
+				retval = 1;
+				break;
+			}
+			len += r;
+			fda_crc_feed(&checksum, state->data, len);
+			if(pass && sink_feed(&sink, state->data, len))
+				retval = -3;
+		}
+		fda_crc_finish(&checksum);
+		if(pass) {
+			if(sink_close(&sink, retval) && !retval)
+				retval = -3;
+		} else if(!retval && fda_crc_match(file, &checksum) < 0) {
+			print_msg("Checksum mismatch in %s\n", file);
+			retval = -4;
+		}
+	}
+	return retval;
 }
 
-static double m_to_ft(double h) {
-	// 1 m = 3.28 ft
-	return h*3.28;
+static int verify_files(struct fda_state* state, const char **files, int count) {
+	int i, retval = 0, r;
+	long size;
+	FILE *fdf;
+
+	for(i = 0; i < count; i++) {
+		fdf = fopen(files[i], "rb");
+		if(!fdf) {
+			perror(files[i]);
+			if(retval != 23)
+				retval = 24;
+			continue;
+		}
+		setvbuf(fdf, NULL, _IONBF, 0);
+		fseek(fdf, 0, SEEK_END);
+		size = ftell(fdf);
+		rewind(fdf);
+		if(size < 0 || fda_reserve(state, size) || fread(state->data, 1, size, fdf) != size) {
+			fclose(fdf);
+			printf("%s: READ ERROR\n", files[i]);
+			if(retval != 23)
+				retval = 24;
+			continue;
+		}
+		fclose(fdf);
+		r = fda_crc_check(files[i], state->data, size);
+		printf("%s: %s\n", files[i], r == 0 ? "OK" : r > 0 ? "NO CHECKSUM" : r == -1 ? "BAD CHECKSUM FILE" : "FAILED");
+		/* a mismatch is worse than a missing checksum */
+		if(r == -2)
+			retval = 23;
+		else if(r && !retval)
+			retval = 25;
+	}
+	return retval;
 }
 
-static double c_to_F(double t) {
-	// multiply by 1.8 (or 9/5) and add 32
-	return t*9/5+32;
+static int fda_read_wait(struct fda_state* state, unsigned char *buf, int n) {
+	time_t start = time(NULL);
+	int r;
+	/* transports return 0 when nothing arrived within their own short timeout */
+	while((r = fda_read(state, buf, n)) == 0) {
+		if(time(NULL) - start >= FDA_READ_TIMEOUT) {
+			fprintf(stderr, "No data from %s for %d seconds, giving up\n", state->tty_device, FDA_READ_TIMEOUT);
+			return -1;
+		}
+		print_msg("no data...\n");
+	}
+	return r;
 }
 
-static double pa_to_psi(double p) {
-	// psi equals to 6894.75729 Pa.
-	return p/6894.75729;
+static int fda_reserve(struct fda_state* state, int size) {
+	if(state->data_capacity < size) {
+		fda_free(state->data);
+		state->data = (unsigned char*) fda_malloc(size*sizeof(unsigned char));
+		state->data_capacity = state->data ? size : 0;
+		if(!state->data) {
+			print_msg("Not enough memory to hold %d bytes\n", size);
+			return -1;
+		}
+	}
+	return 0;
 }
 
+static int fda_dispose(struct fda_state* state) {
+	fda_free(state->data);
+	state->data=NULL;
+	state->data_size=0;
+	state->data_capacity=0;
+	fda_crc_free(&checksum);
+	return 0;
+}
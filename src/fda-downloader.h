@@ -19,24 +19,54 @@
 #ifndef FDA_DOWNLOADER_H_
 #define FDA_DOWNLOADER_H_
 
+struct fda_transport;
+
 struct fda_state {
 	void* handle;
+	const struct fda_transport *ops;    /* set by fda_init() */
 	/*void *options;*/
     const unsigned char *tty_cmd;
     const char * tty_device;
     int cmd_set;
     char selected_cmd;
     int data_size;
+    int data_capacity;
     unsigned char * data;
 };
 
+/**
+ * Transport backend: how bytes go to and from the altimeter.
+ * Functions have the same meaning as fda_init() and friends below.
+ */
+struct fda_transport {
+	const char *scheme;     /* URI prefix, without ':' */
+	int (*open)(void **handle, const char *path);
+	int (*read)(void *handle, unsigned char * buff, int n);
+	int (*write)(void *handle, const unsigned char * buff, int n);
+	int (*flush)(void *handle);
+	int (*close)(void *handle);
+};
+
+/**
+ * Serial port of this platform, NULL if there is none
+ */
+extern const struct fda_transport *const fda_serial_transport;
+
+/**
+ * Find the backend for a device URI ("serial:", "file:", "pty:" or
+ * "replay:"), 'path' is set to the part after the scheme. Devices
+ * without a scheme use the serial port, or a plain file if there is none.
+ * Returns NULL for unknown or unsupported schemes.
+ */
+extern const struct fda_transport *fda_transport_find(const char *uri, const char **path);
+
 /**
  * Default TTY/COM device for each implementation
  */
 extern const char *TTY_DEVICE;
 
 /**
- * Initialize selected TTY/COM device
+ * Initialize selected TTY/COM device, choosing its transport
  */
 extern int fda_init(struct fda_state*);
 
@@ -66,6 +96,59 @@ extern int fda_write(struct fda_state*, const unsigned char * buff, int n);
  */
 extern int fda_close(struct fda_state*);
 
+/**
+ * Called by the daemon for each new device (or new file in watch mode).
+ * Returns 0 to keep watching.
+ */
+typedef int (*fda_device_cb)(void *ctx, const char *device);
+
+/**
+ * Watch 'dir' and call 'cb' every time an entry matching 'pattern'
+ * (shell wildcards) shows up. Runs until SIGINT/SIGTERM or 'cb' fails.
+ */
+extern int fda_daemon_run(const char *dir, const char *pattern, fda_device_cb cb, void *ctx);
+
+/**
+ * Watch 'dir' for complete .fda/.hka files and call 'cb' for each one
+ * not converted before. 'cb' returns 0 when converted, > 0 when the file
+ * is still incomplete. Converted files are recorded in a state file
+ * inside 'dir'. Runs until SIGINT/SIGTERM.
+ */
+extern int fda_watch_run(const char *dir, fda_device_cb cb, void *ctx);
+
+/**
+ * Memory used by the tool. Freed blocks are kept for reuse, so the
+ * counters show whether a run keeps asking the system for more.
+ */
+struct fda_mem_stats {
+	unsigned long requests;     /* fda_malloc() and friends calls */
+	unsigned long allocations;  /* blocks taken from the system */
+	size_t held;                /* bytes taken from the system, free ones included */
+	size_t peak;                /* highest 'held' */
+	size_t limit;               /* budget in bytes, 0 if none */
+};
+
+/**
+ * Same as malloc() and friends, within the memory limit. Blocks must be
+ * released with fda_free().
+ */
+extern void *fda_malloc(size_t size);
+extern void *fda_calloc(size_t n, size_t size);
+extern void *fda_realloc(void *ptr, size_t size);
+extern void fda_free(void *ptr);
+
+/**
+ * Set memory limit from "<n>[K|M|G]" bytes. Returns 0 if valid.
+ */
+extern int fda_mem_limit(const char *spec);
+
+extern void fda_mem_stats(struct fda_mem_stats *stats);
+
+/**
+ * Print memory counters (verbose mode), 'when' tells the reader when
+ */
+extern void fda_mem_report(const char *when);
+
 /**
  * Helper functions
  */
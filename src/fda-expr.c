@@ -0,0 +1,473 @@
+/**
+ * fda-downloader - Simple reader for FlyDream Altimeter or Hobbyking Altimeter
+ *
+ * Copyright (C) 2017  OLopes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include "fda-downloader.h"
+#include "fda-pipeline.h"
+
+/* opcodes, every one of them works on a whole block */
+enum {
+	OP_CONST, OP_LOAD,
+	OP_NEG, OP_NOT, OP_ABS, OP_SQRT,
+	OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD, OP_MIN, OP_MAX,
+	OP_LT, OP_LE, OP_GT, OP_GE, OP_EQ, OP_NE, OP_AND, OP_OR
+};
+
+/* variables */
+enum {
+	VAR_TIME, VAR_PRESSURE, VAR_TEMPERATURE, VAR_ALTITUDE, VAR_SMOOTH,
+	VAR_VSPEED, VAR_LAUNCH, VAR_SESSION, VAR_RATE, VAR_COUNT
+};
+
+static const char *var_names[VAR_COUNT] = {
+	"time", "pressure", "temperature", "altitude", "smooth",
+	"vspeed", "launch", "session", "rate"
+};
+
+/**
+ * Recursive descent parser state
+ */
+struct parser {
+	struct fda_expr *e;
+	const char *text, *p;
+	const char *err;
+	int depth;
+};
+
+static int parse_or(struct parser *ps);
+
+static void skip_space(struct parser *ps) {
+	while(isspace((unsigned char)*ps->p))
+		ps->p++;
+}
+
+static int accept(struct parser *ps, const char *tok) {
+	size_t len = strlen(tok);
+	skip_space(ps);
+	if(strncmp(ps->p, tok, len))
+		return 0;
+	/* don't take '<' out of "<=" or '=' out of "==" */
+	if(len == 1 && (*tok == '<' || *tok == '>' || *tok == '!') && ps->p[1] == '=')
+		return 0;
+	ps->p += len;
+	return 1;
+}
+
+static int fail(struct parser *ps, const char *err) {
+	if(!ps->err)
+		ps->err = err;
+	return -1;
+}
+
+/**
+ * Append instruction and track stack usage
+ */
+static int emit(struct parser *ps, int op, int arg, double k) {
+	struct fda_expr *e = ps->e;
+	if(e->n == FDA_EXPR_CODE)
+		return fail(ps, "expression too long");
+	e->code[e->n].op = op;
+	e->code[e->n].arg = arg;
+	e->code[e->n].k = k;
+	e->n++;
+	switch(op) {
+	case OP_CONST:
+	case OP_LOAD:
+		ps->depth++;
+		if(ps->depth > FDA_EXPR_STACK)
+			return fail(ps, "expression too deep");
+		if(ps->depth > e->depth)
+			e->depth = ps->depth;
+		break;
+	case OP_NEG:
+	case OP_NOT:
+	case OP_ABS:
+	case OP_SQRT:
+		break;
+	default:
+		ps->depth--;
+	}
+	return 0;
+}
+
+static int parse_call(struct parser *ps, const char *name, size_t len) {
+	static const struct { const char *name; int op, args; } funcs[] = {
+		{ "abs", OP_ABS, 1 }, { "sqrt", OP_SQRT, 1 },
+		{ "min", OP_MIN, 2 }, { "max", OP_MAX, 2 }
+	};
+	int i, n;
+	for(i = 0; i < sizeof(funcs)/sizeof(funcs[0]); i++) {
+		if(strlen(funcs[i].name) == len && !strncmp(funcs[i].name, name, len))
+			break;
+	}
+	if(i == sizeof(funcs)/sizeof(funcs[0]))
+		return fail(ps, "unknown function");
+	for(n = 0; n < funcs[i].args; n++) {
+		if(n > 0 && !accept(ps, ","))
+			return fail(ps, "',' expected");
+		if(parse_or(ps))
+			return -1;
+	}
+	if(!accept(ps, ")"))
+		return fail(ps, "')' expected");
+	return emit(ps, funcs[i].op, 0, 0);
+}
+
+static int parse_primary(struct parser *ps) {
+	const char *name;
+	char *end;
+	double k;
+	size_t len;
+	int i;
+
+	skip_space(ps);
+	if(accept(ps, "(")) {
+		if(parse_or(ps))
+			return -1;
+		return accept(ps, ")") ? 0 : fail(ps, "')' expected");
+	}
+	if(isdigit((unsigned char)*ps->p) || *ps->p == '.') {
+		k = strtod(ps->p, &end);
+		if(end == ps->p)
+			return fail(ps, "invalid number");
+		ps->p = end;
+		return emit(ps, OP_CONST, 0, k);
+	}
+	if(!isalpha((unsigned char)*ps->p) && *ps->p != '_')
+		return fail(ps, "value expected");
+
+	name = ps->p;
+	while(isalnum((unsigned char)*ps->p) || *ps->p == '_')
+		ps->p++;
+	len = ps->p-name;
+	if(accept(ps, "("))
+		return parse_call(ps, name, len);
+	for(i = 0; i < VAR_COUNT; i++) {
+		if(strlen(var_names[i]) == len && !strncmp(var_names[i], name, len))
+			break;
+	}
+	/* "ts" is the column name used by the decoder */
+	if(len == 2 && !strncmp(name, "ts", 2))
+		i = VAR_TIME;
+	if(i == VAR_COUNT)
+		return fail(ps, "unknown variable");
+	ps->e->vars |= 1 << i;
+	return emit(ps, OP_LOAD, i, 0);
+}
+
+static int parse_unary(struct parser *ps) {
+	if(accept(ps, "-"))
+		return parse_unary(ps) || emit(ps, OP_NEG, 0, 0);
+	if(accept(ps, "!"))
+		return parse_unary(ps) || emit(ps, OP_NOT, 0, 0);
+	return parse_primary(ps);
+}
+
+/**
+ * Left associative binary operators of one precedence level
+ */
+static int parse_binary(struct parser *ps, int (*next)(struct parser *),
+		const char **tokens, const int *ops) {
+	int i;
+	if((*next)(ps))
+		return -1;
+	for(;;) {
+		for(i = 0; tokens[i]; i++) {
+			if(accept(ps, tokens[i]))
+				break;
+		}
+		if(!tokens[i])
+			return 0;
+		if((*next)(ps) || emit(ps, ops[i], 0, 0))
+			return -1;
+	}
+}
+
+static int parse_mul(struct parser *ps) {
+	static const char *tokens[] = { "*", "/", "%", NULL };
+	static const int ops[] = { OP_MUL, OP_DIV, OP_MOD };
+	return parse_binary(ps, &parse_unary, tokens, ops);
+}
+
+static int parse_add(struct parser *ps) {
+	static const char *tokens[] = { "+", "-", NULL };
+	static const int ops[] = { OP_ADD, OP_SUB };
+	return parse_binary(ps, &parse_mul, tokens, ops);
+}
+
+static int parse_cmp(struct parser *ps) {
+	static const char *tokens[] = { "<=", ">=", "==", "!=", "<", ">", NULL };
+	static const int ops[] = { OP_LE, OP_GE, OP_EQ, OP_NE, OP_LT, OP_GT };
+	return parse_binary(ps, &parse_add, tokens, ops);
+}
+
+static int parse_and(struct parser *ps) {
+	static const char *tokens[] = { "&&", NULL };
+	static const int ops[] = { OP_AND };
+	return parse_binary(ps, &parse_cmp, tokens, ops);
+}
+
+static int parse_or(struct parser *ps) {
+	static const char *tokens[] = { "||", NULL };
+	static const int ops[] = { OP_OR };
+	return parse_binary(ps, &parse_and, tokens, ops);
+}
+
+int fda_expr_compile(struct fda_expr *e, const char *text, const char **err) {
+	struct parser ps;
+
+	memset(e, 0, sizeof(struct fda_expr));
+	ps.e = e;
+	ps.text = ps.p = text;
+	ps.err = NULL;
+	ps.depth = 0;
+	if(!parse_or(&ps)) {
+		skip_space(&ps);
+		if(*ps.p)
+			fail(&ps, "unexpected character");
+	}
+	if(ps.err) {
+		*err = ps.err;
+		return ps.p-text+1;
+	}
+	return 0;
+}
+
+int fda_query_add(struct fda_query *q, const char *spec, const char **err) {
+	const char *eq = spec;
+	int len, retval;
+
+	if(q->n_expr == FDA_MAX_EXPR) {
+		*err = "too many expressions";
+		return 1;
+	}
+	/* name=expression */
+	while(isalnum((unsigned char)*eq) || *eq == '_')
+		eq++;
+	len = eq-spec;
+	if(*eq != '=' || eq[1] == '=' || len == 0 || len >= sizeof(q->names[0])) {
+		*err = "name=expression expected";
+		return 1;
+	}
+	retval = fda_expr_compile(&q->expr[q->n_expr], eq+1, err);
+	if(retval)
+		return retval+len+1;
+	memcpy(q->names[q->n_expr], spec, len);
+	q->names[q->n_expr][len] = '\0';
+	q->n_expr++;
+	return 0;
+}
+
+int fda_query_where(struct fda_query *q, const char *text, const char **err) {
+	struct fda_expr e, *w = &q->where;
+	int retval = fda_expr_compile(&e, text, err);
+	if(retval)
+		return retval;
+	if(!q->has_where) {
+		*w = e;
+		q->has_where = 1;
+		return 0;
+	}
+	/* repeated filters must all hold: append the new code and an AND */
+	if(w->n+e.n+1 > FDA_EXPR_CODE) {
+		*err = "expression too long";
+		return 1;
+	}
+	if(e.depth+1 > FDA_EXPR_STACK) {
+		*err = "expression too deep";
+		return 1;
+	}
+	memcpy(w->code+w->n, e.code, e.n*sizeof(struct fda_expr_op));
+	w->n += e.n;
+	w->code[w->n].op = OP_AND;
+	w->code[w->n].arg = 0;
+	w->code[w->n].k = 0;
+	w->n++;
+	if(e.depth+1 > w->depth)
+		w->depth = e.depth+1;
+	w->vars |= e.vars;
+	return 0;
+}
+
+struct fda_query_eval *fda_query_open(const struct fda_query *q, const struct fda_units *units, int smooth) {
+	struct fda_query_eval *ev;
+	ev = (struct fda_query_eval *) fda_malloc(sizeof(struct fda_query_eval));
+	if(!ev)
+		return NULL;
+	ev->query = q;
+	ev->units = units;
+	ev->smooth = smooth;
+	ev->launch = ev->prev = 0.0;
+	ev->primed = 0;
+	return ev;
+}
+
+void fda_query_close(struct fda_query_eval *ev) {
+	fda_free(ev);
+}
+
+/**
+ * Columns that are not stored in the block
+ */
+static void derive(struct fda_query_eval *ev, const struct fda_block *blk, int vars) {
+	const double *alt = blk->altitude;
+	double prev;
+	int i;
+
+	/* height in output units: smoothed when smoothing is on */
+	if(vars & (1 << VAR_VSPEED | 1 << VAR_LAUNCH)) {
+		if(ev->smooth)
+			alt = blk->smooth;
+		for(i = 0; i < blk->n; i++)
+			ev->height[i] = (*ev->units->f_height)(alt[i]);
+		if(!ev->primed && blk->n > 0) {
+			ev->launch = ev->prev = ev->height[0];
+			ev->primed = 1;
+		}
+	}
+	if(vars & 1 << VAR_VSPEED) {
+		prev = ev->prev;
+		for(i = 0; i < blk->n; i++) {
+			ev->vspeed[i] = (ev->height[i]-prev)*blk->freq;
+			prev = ev->height[i];
+		}
+		if(blk->n > 0)
+			ev->prev = prev;
+	}
+}
+
+/**
+ * Load variable 'var' of every sample in the block into 'out'
+ */
+static void load(struct fda_query_eval *ev, const struct fda_block *blk, int var, double *out) {
+	const struct fda_units *units = ev->units;
+	int i, n = blk->n;
+
+	switch(var) {
+	case VAR_TIME:
+		memcpy(out, blk->ts, n*sizeof(double));
+		break;
+	case VAR_PRESSURE:
+		for(i = 0; i < n; i++)
+			out[i] = (*units->f_pressure)(blk->pressure[i]);
+		break;
+	case VAR_TEMPERATURE:
+		for(i = 0; i < n; i++)
+			out[i] = (*units->f_temperature)(blk->temperature[i]);
+		break;
+	case VAR_ALTITUDE:
+		for(i = 0; i < n; i++)
+			out[i] = (*units->f_height)(blk->altitude[i]);
+		break;
+	case VAR_SMOOTH:
+		for(i = 0; i < n; i++)
+			out[i] = (*units->f_height)(ev->smooth ? blk->smooth[i] : blk->altitude[i]);
+		break;
+	case VAR_VSPEED:
+		memcpy(out, ev->vspeed, n*sizeof(double));
+		break;
+	case VAR_LAUNCH:
+		for(i = 0; i < n; i++)
+			out[i] = ev->launch;
+		break;
+	case VAR_SESSION:
+		for(i = 0; i < n; i++)
+			out[i] = blk->session;
+		break;
+	case VAR_RATE:
+		for(i = 0; i < n; i++)
+			out[i] = blk->freq;
+		break;
+	}
+}
+
+/**
+ * Run program 'e' over the block, result in 'out'
+ */
+static void run(struct fda_query_eval *ev, const struct fda_expr *e,
+		const struct fda_block *blk, double *out) {
+	double (*st)[FDA_BLOCK_SIZE] = ev->stack;
+	double *a, *b;
+	int pc, sp = 0, i, n = blk->n;
+
+	for(pc = 0; pc < e->n; pc++) {
+		const struct fda_expr_op *op = &e->code[pc];
+		/* b is the top of the stack, a the value below it */
+		a = st[sp > 1 ? sp-2 : 0];
+		b = st[sp > 0 ? sp-1 : 0];
+		switch(op->op) {
+		case OP_CONST:
+			for(i = 0; i < n; i++)
+				st[sp][i] = op->k;
+			sp++;
+			continue;
+		case OP_LOAD:
+			load(ev, blk, op->arg, st[sp++]);
+			continue;
+		case OP_NEG:  for(i = 0; i < n; i++) b[i] = -b[i]; continue;
+		case OP_NOT:  for(i = 0; i < n; i++) b[i] = !b[i]; continue;
+		case OP_ABS:  for(i = 0; i < n; i++) b[i] = fabs(b[i]); continue;
+		case OP_SQRT: for(i = 0; i < n; i++) b[i] = sqrt(b[i]); continue;
+		case OP_ADD:  for(i = 0; i < n; i++) a[i] += b[i]; break;
+		case OP_SUB:  for(i = 0; i < n; i++) a[i] -= b[i]; break;
+		case OP_MUL:  for(i = 0; i < n; i++) a[i] *= b[i]; break;
+		case OP_DIV:  for(i = 0; i < n; i++) a[i] /= b[i]; break;
+		case OP_MOD:  for(i = 0; i < n; i++) a[i] = fmod(a[i], b[i]); break;
+		case OP_MIN:  for(i = 0; i < n; i++) a[i] = b[i] < a[i] ? b[i] : a[i]; break;
+		case OP_MAX:  for(i = 0; i < n; i++) a[i] = b[i] > a[i] ? b[i] : a[i]; break;
+		case OP_LT:   for(i = 0; i < n; i++) a[i] = a[i] < b[i]; break;
+		case OP_LE:   for(i = 0; i < n; i++) a[i] = a[i] <= b[i]; break;
+		case OP_GT:   for(i = 0; i < n; i++) a[i] = a[i] > b[i]; break;
+		case OP_GE:   for(i = 0; i < n; i++) a[i] = a[i] >= b[i]; break;
+		case OP_EQ:   for(i = 0; i < n; i++) a[i] = a[i] == b[i]; break;
+		case OP_NE:   for(i = 0; i < n; i++) a[i] = a[i] != b[i]; break;
+		case OP_AND:  for(i = 0; i < n; i++) a[i] = a[i] && b[i]; break;
+		case OP_OR:   for(i = 0; i < n; i++) a[i] = a[i] || b[i]; break;
+		}
+		sp--;
+	}
+	memcpy(out, st[0], n*sizeof(double));
+}
+
+int fda_query_block(struct fda_query_eval *ev, const struct fda_block *blk) {
+	const struct fda_query *q = ev->query;
+	int i, vars = q->where.vars, kept = 0;
+
+	for(i = 0; i < q->n_expr; i++)
+		vars |= q->expr[i].vars;
+	derive(ev, blk, vars);
+
+	for(i = 0; i < q->n_expr; i++)
+		run(ev, &q->expr[i], blk, ev->values[i]);
+	if(!q->has_where) {
+		memset(ev->keep, 1, blk->n);
+		return blk->n;
+	}
+	run(ev, &q->where, blk, ev->stack[FDA_EXPR_STACK]);
+	for(i = 0; i < blk->n; i++)
+		kept += ev->keep[i] = ev->stack[FDA_EXPR_STACK][i] != 0;
+	return kept;
+}
+
+void fda_query_session(struct fda_query_eval *ev) {
+	ev->primed = 0;
+}
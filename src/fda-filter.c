@@ -0,0 +1,102 @@
+/**
+ * fda-downloader - Simple reader for FlyDream Altimeter or Hobbyking Altimeter
+ *
+ * Copyright (C) 2017  OLopes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "fda-downloader.h"
+#include "fda-pipeline.h"
+
+/* defaults: a few m/s2 of unmodelled acceleration, ~1 m of sensor noise */
+#define FDA_FILTER_Q 4.0
+#define FDA_FILTER_R 1.0
+
+int fda_filter_parse(struct fda_filter *f, const char *spec) {
+	char extra;
+	memset(f, 0, sizeof(struct fda_filter));
+	f->q = FDA_FILTER_Q;
+	f->r = FDA_FILTER_R;
+	if(spec == NULL || !*spec)
+		return 0;
+	switch(sscanf(spec, "%lf:%lf%c", &f->q, &f->r, &extra)) {
+	case 1:
+	case 2:
+		break;
+	default:
+		return 1;
+	}
+	if(f->q <= 0 || f->r <= 0)
+		return 2;
+	return 0;
+}
+
+void fda_filter_reset(struct fda_filter *f, double dt) {
+	f->dt = dt;
+	f->h = f->v = 0.0;
+	f->p00 = f->r;
+	f->p01 = 0.0;
+	/* vertical speed is unknown at session start */
+	f->p11 = 1e4;
+	f->primed = 0;
+}
+
+void fda_filter_block(struct fda_filter *f, const double *z, double *out, int n) {
+	int i;
+	double dt = f->dt, y, s;
+	double q00 = f->q*dt*dt*dt*dt/4, q01 = f->q*dt*dt*dt/2, q11 = f->q*dt*dt;
+	double p00 = f->p00, p01 = f->p01, p11 = f->p11;
+	double h = f->h, v = f->v;
+
+	if(n <= 0)
+		return;
+
+	/* start from the first measurement instead of ground zero */
+	if(!f->primed) {
+		h = z[0];
+		f->primed = 1;
+	}
+
+	/* covariance and gains don't depend on the measurements: compute them first */
+	for(i = 0; i < n; i++) {
+		/* predict: P = F.P.F' + Q */
+		p00 += dt*(2*p01 + dt*p11) + q00;
+		p01 += dt*p11 + q01;
+		p11 += q11;
+		/* update */
+		s = p00 + f->r;
+		f->k0[i] = p00/s;
+		f->k1[i] = p01/s;
+		p11 -= f->k1[i]*p01;
+		p01 -= f->k0[i]*p01;
+		p00 -= f->k0[i]*p00;
+	}
+
+	/* run the state recursion with the precomputed gains */
+	for(i = 0; i < n; i++) {
+		h += v*dt;
+		y = z[i] - h;
+		h += f->k0[i]*y;
+		v += f->k1[i]*y;
+		out[i] = h;
+	}
+
+	f->p00 = p00;
+	f->p01 = p01;
+	f->p11 = p11;
+	f->h = h;
+	f->v = v;
+}
@@ -0,0 +1,313 @@
+/**
+ * fda-downloader - Simple reader for FlyDream Altimeter or Hobbyking Altimeter
+ *
+ * Copyright (C) 2017  OLopes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "fda-downloader.h"
+#include "fda-pipeline.h"
+
+/* quantile sketch: log buckets with 1% relative accuracy */
+#define FDA_SKETCH_ALPHA   0.01
+#define FDA_SKETCH_BUCKETS 2048
+#define FDA_SKETCH_OFFSET  512
+/* smaller magnitudes count as zero */
+#define FDA_SKETCH_MIN     1e-3
+
+#define FDA_FLEET_METRICS  3
+#define FDA_FLEET_BINS     400
+
+/**
+ * Histogram layout of every metric
+ */
+static const struct {
+	const char *name;
+	double start, width;
+	int bins;
+} metrics[FDA_FLEET_METRICS] = {
+	{ "apex_altitude", 0.0, 25.0, 400 },    /* m above launch */
+	{ "duration", 0.0, 10.0, 360 },         /* s */
+	{ "temperature", -40.0, 1.0, 100 }      /* session mean, C */
+};
+
+/**
+ * Mergeable quantile sketch (DDSketch)
+ */
+struct fda_sketch {
+	long long pos[FDA_SKETCH_BUCKETS];
+	long long neg[FDA_SKETCH_BUCKETS];
+	long long zero;
+};
+
+struct fleet_metric {
+	long long count;
+	double sum, min, max;
+	long long under, over;
+	long long bins[FDA_FLEET_BINS];
+	struct fda_sketch sketch;
+};
+
+/**
+ * Partial aggregates and buffers of one worker
+ */
+struct fleet_part {
+	struct fleet_metric m[FDA_FLEET_METRICS];
+	long long files, failed, sessions;
+	unsigned char *data;    /* file contents, reused */
+	long cap;
+	struct fda_decoder dec;
+	/* session being decoded */
+	double launch, apex, temp_sum;
+	long samples;
+};
+
+struct fleet {
+	const char **files;
+	struct fleet_part *parts;
+};
+
+static double sketch_gamma(void) {
+	return (1+FDA_SKETCH_ALPHA)/(1-FDA_SKETCH_ALPHA);
+}
+
+static int sketch_index(double v) {
+	int i = (int)ceil(log(v)/log(sketch_gamma())) + FDA_SKETCH_OFFSET;
+	return i < 0 ? 0 : i >= FDA_SKETCH_BUCKETS ? FDA_SKETCH_BUCKETS-1 : i;
+}
+
+static double sketch_value(int i) {
+	double g = sketch_gamma();
+	return 2*pow(g, i-FDA_SKETCH_OFFSET)/(g+1);
+}
+
+static void sketch_add(struct fda_sketch *s, double v) {
+	if(v > FDA_SKETCH_MIN)
+		s->pos[sketch_index(v)]++;
+	else if(v < -FDA_SKETCH_MIN)
+		s->neg[sketch_index(-v)]++;
+	else
+		s->zero++;
+}
+
+/**
+ * Value at rank q*(count-1), within FDA_SKETCH_ALPHA
+ */
+static double sketch_quantile(const struct fda_sketch *s, long long count, double q) {
+	long long rank = (long long)floor(q*(count-1)), seen = 0;
+	int i;
+	for(i = FDA_SKETCH_BUCKETS-1; i >= 0; i--) {
+		if((seen += s->neg[i]) > rank)
+			return -sketch_value(i);
+	}
+	if((seen += s->zero) > rank)
+		return 0.0;
+	for(i = 0; i < FDA_SKETCH_BUCKETS; i++) {
+		if((seen += s->pos[i]) > rank)
+			return sketch_value(i);
+	}
+	return 0.0;
+}
+
+static void metric_add(struct fleet_metric *m, int k, double v) {
+	long bin = (long)floor((v-metrics[k].start)/metrics[k].width);
+	if(m->count == 0 || v < m->min)
+		m->min = v;
+	if(m->count == 0 || v > m->max)
+		m->max = v;
+	m->count++;
+	m->sum += v;
+	if(bin < 0)
+		m->under++;
+	else if(bin >= metrics[k].bins)
+		m->over++;
+	else
+		m->bins[bin]++;
+	sketch_add(&m->sketch, v);
+}
+
+static void metric_merge(struct fleet_metric *to, const struct fleet_metric *from) {
+	int i;
+	if(!from->count)
+		return;
+	if(!to->count || from->min < to->min)
+		to->min = from->min;
+	if(!to->count || from->max > to->max)
+		to->max = from->max;
+	to->count += from->count;
+	to->sum += from->sum;
+	to->under += from->under;
+	to->over += from->over;
+	for(i = 0; i < FDA_FLEET_BINS; i++)
+		to->bins[i] += from->bins[i];
+	for(i = 0; i < FDA_SKETCH_BUCKETS; i++) {
+		to->sketch.pos[i] += from->sketch.pos[i];
+		to->sketch.neg[i] += from->sketch.neg[i];
+	}
+	to->sketch.zero += from->sketch.zero;
+}
+
+/**
+ * Decoder callback: per session apex, duration and temperature
+ */
+static int fleet_block(void *ctx, int event, struct fda_block *blk) {
+	struct fleet_part *part = (struct fleet_part *)ctx;
+	int i;
+
+	switch(event) {
+	case FDA_SESSION_START:
+		part->samples = 0;
+		part->temp_sum = 0.0;
+		break;
+	case FDA_SAMPLES:
+		if(part->samples == 0 && blk->n > 0)
+			part->launch = part->apex = blk->altitude[0];
+		for(i = 0; i < blk->n; i++) {
+			if(blk->altitude[i] > part->apex)
+				part->apex = blk->altitude[i];
+			part->temp_sum += blk->temperature[i];
+		}
+		part->samples += blk->n;
+		break;
+	case FDA_SESSION_END:
+		if(part->samples > 0) {
+			metric_add(&part->m[0], 0, part->apex-part->launch);
+			metric_add(&part->m[1], 1, (double)part->samples/blk->freq);
+			metric_add(&part->m[2], 2, part->temp_sum/part->samples);
+			part->sessions++;
+		}
+		break;
+	}
+	return 0;
+}
+
+/**
+ * Worker task: read and aggregate file 'i'. Bad files are counted, not fatal.
+ */
+static int fleet_file(void *ctx, int worker, int i) {
+	struct fleet *fleet = (struct fleet *)ctx;
+	struct fleet_part *part = &fleet->parts[worker];
+	const char *file = fleet->files[i];
+	FILE *fdf;
+	long size;
+	unsigned char *data;
+
+	part->files++;
+	fdf = fopen(file, "rb");
+	if(!fdf) {
+		print_msg("Error opening %s\n", file);
+		part->failed++;
+		return 0;
+	}
+	setvbuf(fdf, NULL, _IONBF, 0);
+	fseek(fdf, 0, SEEK_END);
+	size = ftell(fdf);
+	rewind(fdf);
+	if(size > part->cap) {
+		data = (unsigned char *) fda_realloc(part->data, size);
+		if(!data) {
+			/* too big for the memory limit: skip it, smaller files may still fit */
+			print_msg("Not enough memory to read %s\n", file);
+			fclose(fdf);
+			part->failed++;
+			return 0;
+		}
+		part->data = data;
+		part->cap = size;
+	}
+	if(size < FDA_HEADER_SIZE+FDA_SAMPLE_SIZE || fread(part->data, 1, size, fdf) != size
+			|| !fda_valid_header(part->data) || fda_data_size(part->data) > size) {
+		print_msg("%s is not a complete FDA/HKA file\n", file);
+		fclose(fdf);
+		part->failed++;
+		return 0;
+	}
+	fclose(fdf);
+	/* don't trust files whose checksum doesn't match */
+	if(fda_crc_check(file, part->data, size) < 0) {
+		print_msg("Checksum mismatch in %s\n", file);
+		part->failed++;
+		return 0;
+	}
+	part->dec.ctx = part;
+	return fda_decode(&part->dec, part->data, fda_data_size(part->data));
+}
+
+static void write_metric(FILE *out, int k, const struct fleet_metric *m) {
+	static const double quantiles[] = { 0.01, 0.05, 0.25, 0.5, 0.75, 0.95, 0.99 };
+	int i, last;
+
+	fprintf(out, "\"%s\":{\"count\":%lld", metrics[k].name, m->count);
+	if(m->count > 0) {
+		fprintf(out, ",\"min\":%.2f,\"max\":%.2f,\"mean\":%.2f,\"quantiles\":{",
+			m->min, m->max, m->sum/m->count);
+		for(i = 0; i < sizeof(quantiles)/sizeof(quantiles[0]); i++)
+			fprintf(out, "%s\"p%g\":%.2f", i ? "," : "", quantiles[i]*100,
+				sketch_quantile(&m->sketch, m->count, quantiles[i]));
+		fprintf(out, "}");
+	}
+	/* trailing empty bins are left out */
+	for(last = metrics[k].bins; last > 0 && !m->bins[last-1]; last--)
+		;
+	fprintf(out, ",\"histogram\":{\"start\":%g,\"width\":%g,\"underflow\":%lld,\"overflow\":%lld,\"counts\":[",
+		metrics[k].start, metrics[k].width, m->under, m->over);
+	for(i = 0; i < last; i++)
+		fprintf(out, "%s%lld", i ? "," : "", m->bins[i]);
+	fprintf(out, "]}}");
+}
+
+int fda_fleet_run(FILE *out, const char **files, int count, int workers) {
+	struct fleet fleet;
+	struct fleet_part *total;
+	int i, k, retval;
+
+	if(workers < 1)
+		workers = 1;
+	fleet.files = files;
+	fleet.parts = (struct fleet_part *) fda_calloc(workers+1, sizeof(struct fleet_part));
+	if(!fleet.parts)
+		return -5;
+	for(i = 0; i < workers; i++) {
+		fleet.parts[i].dec.filter = NULL;
+		fleet.parts[i].dec.fixed = 0;
+		fleet.parts[i].dec.cb = &fleet_block;
+	}
+	retval = fda_pool_run(workers, count, &fleet_file, &fleet);
+
+	/* merge partial aggregates */
+	total = &fleet.parts[workers];
+	for(i = 0; i < workers; i++) {
+		for(k = 0; k < FDA_FLEET_METRICS; k++)
+			metric_merge(&total->m[k], &fleet.parts[i].m[k]);
+		total->files += fleet.parts[i].files;
+		total->failed += fleet.parts[i].failed;
+		total->sessions += fleet.parts[i].sessions;
+		fda_free(fleet.parts[i].data);
+	}
+
+	if(!retval) {
+		fprintf(out, "{\"files\":%lld,\"failed\":%lld,\"sessions\":%lld,\"units\":\"metric\",\n",
+			total->files, total->failed, total->sessions);
+		for(k = 0; k < FDA_FLEET_METRICS; k++) {
+			write_metric(out, k, &total->m[k]);
+			fprintf(out, k < FDA_FLEET_METRICS-1 ? ",\n" : "\n}\n");
+		}
+	}
+	fda_free(fleet.parts);
+	return retval;
+}
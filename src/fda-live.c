@@ -0,0 +1,146 @@
+/**
+ * fda-downloader - Simple reader for FlyDream Altimeter or Hobbyking Altimeter
+ *
+ * Copyright (C) 2017  OLopes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "fda-downloader.h"
+#include "fda-pipeline.h"
+#include "fda-live.h"
+
+#if defined(__unix__)
+
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Non zero if feed 'name' exists and its writer marked it done
+ */
+static int feed_finished(const char *name) {
+	struct fda_live_ring *ring;
+	struct stat st;
+	int fd, done = 0;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if(fd == -1)
+		return 0;
+	if(!fstat(fd, &st) && st.st_size >= sizeof(struct fda_live_ring)) {
+		ring = (struct fda_live_ring *) mmap(NULL, sizeof(struct fda_live_ring), PROT_READ, MAP_SHARED, fd, 0);
+		if(ring != MAP_FAILED) {
+			done = __atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) == FDA_LIVE_MAGIC
+				&& __atomic_load_n(&ring->done, __ATOMIC_ACQUIRE);
+			munmap(ring, sizeof(struct fda_live_ring));
+		}
+	}
+	close(fd);
+	return done;
+}
+
+int fda_live_open(struct fda_live *live, const char *name) {
+	int fd;
+	void *mem;
+
+	memset(live, 0, sizeof(struct fda_live));
+	fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	/* a finished feed is replaced, one still being published is not */
+	if(fd == -1 && errno == EEXIST && feed_finished(name) && !shm_unlink(name))
+		fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if(fd == -1) {
+		perror("Error creating live feed");
+		if(errno == EEXIST)
+			print_msg("Live feed %s is still published by another process, remove it if that one died\n", name);
+		return -1;
+	}
+	if(ftruncate(fd, sizeof(struct fda_live_ring)) == -1) {
+		perror("Error sizing live feed");
+		close(fd);
+		return -2;
+	}
+	mem = mmap(NULL, sizeof(struct fda_live_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(mem == MAP_FAILED) {
+		perror("Error mapping live feed");
+		return -3;
+	}
+
+	live->ring = (struct fda_live_ring *)mem;
+	live->ring->capacity = FDA_LIVE_CAPACITY;
+	live->ring->sample_size = sizeof(struct fda_live_sample);
+	live->ring->version = FDA_LIVE_VERSION;
+	/* magic goes last, readers may check it to know the feed is ready */
+	__atomic_store_n(&live->ring->magic, FDA_LIVE_MAGIC, __ATOMIC_RELEASE);
+	print_msg("Live feed %s ready\n", name);
+	return 0;
+}
+
+int fda_live_block(void *ctx, int event, struct fda_block *blk) {
+	struct fda_live *live = (struct fda_live *)ctx;
+	struct fda_live_ring *ring = live->ring;
+	struct fda_live_sample *s;
+	int i;
+
+	if(event != FDA_SAMPLES)
+		return 0;
+
+	/* announce the slots about to be rewritten before touching them */
+	__atomic_store_n(&ring->cursor, live->seq + blk->n, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	for(i = 0; i < blk->n; i++) {
+		s = &ring->samples[(live->seq + i) & (FDA_LIVE_CAPACITY-1)];
+		s->ts = blk->ts[i];
+		s->altitude = blk->altitude[i];
+		s->pressure = blk->pressure[i];
+		s->temperature = blk->temperature[i];
+		s->session = blk->session;
+	}
+	/* publish the whole block at once */
+	live->seq += blk->n;
+	__atomic_store_n(&ring->seq, live->seq, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int fda_live_close(struct fda_live *live) {
+	if(!live->ring)
+		return 0;
+	__atomic_store_n(&live->ring->done, 1, __ATOMIC_RELEASE);
+	/* the feed is kept so late readers can still replay the tail */
+	munmap(live->ring, sizeof(struct fda_live_ring));
+	live->ring = NULL;
+	return 0;
+}
+
+#else
+
+int fda_live_open(struct fda_live *live, const char *name) {
+	memset(live, 0, sizeof(struct fda_live));
+	print_msg("Live feed not supported on this platform\n");
+	return -1;
+}
+
+int fda_live_block(void *ctx, int event, struct fda_block *blk) {
+	return 0;
+}
+
+int fda_live_close(struct fda_live *live) {
+	return 0;
+}
+
+#endif
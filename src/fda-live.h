@@ -0,0 +1,64 @@
+/**
+ * fda-downloader - Simple reader for FlyDream Altimeter or Hobbyking Altimeter
+ *
+ * Copyright (C) 2017  OLopes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef FDA_LIVE_H_
+#define FDA_LIVE_H_
+
+#include <stdint.h>
+
+/**
+ * Live sample feed published in POSIX shared memory while uploading.
+ *
+ * There is a single writer (fda-downloader). Before writing a block of
+ * samples it moves 'cursor' to the end of the block (followed by a release
+ * fence), then writes sample i to slot (i % capacity) and finally advances
+ * 'seq' with release semantics. 'seq' holds the number of samples
+ * published so far, slots from cursor-capacity up may be in rewrite.
+ *
+ * Readers shm_open() the feed read only, keep their own counter and poll 'seq':
+ *   1. s = seq (acquire); copy slots [max(last, s-capacity), s)
+ *   2. acquire fence; c = cursor; slots below c-capacity may have been
+ *      overwritten while copying and must be discarded
+ *   3. last = s
+ * Once 'done' is set no more samples will be published.
+ */
+#define FDA_LIVE_MAGIC    0x0fda11feu
+#define FDA_LIVE_VERSION  2
+#define FDA_LIVE_CAPACITY 65536  /* must be a power of two */
+
+struct fda_live_sample {
+	double ts;           /* seconds since session start */
+	double altitude;     /* meters */
+	int32_t pressure;    /* Pa */
+	int16_t temperature; /* degree Celsius */
+	uint16_t session;    /* session number, starting at 1 */
+};
+
+struct fda_live_ring {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t capacity;
+	uint32_t sample_size;
+	volatile uint32_t done;
+	uint32_t reserved;
+	volatile uint64_t seq;
+	volatile uint64_t cursor;   /* end of the block being written */
+	struct fda_live_sample samples[FDA_LIVE_CAPACITY];
+};
+
+#endif /* FDA_LIVE_H_ */
@@ -0,0 +1,183 @@
+/**
+ * fda-downloader - Simple reader for FlyDream Altimeter or Hobbyking Altimeter
+ *
+ * Copyright (C) 2017  OLopes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fda-downloader.h"
+#include "fda-pipeline.h"
+
+int fda_lod_open(struct fda_lod *lod, const char *file, const char *dlm) {
+	memset(lod, 0, sizeof(struct fda_lod));
+	lod->fdf = fda_open_output(file, "w");
+	if(!lod->fdf) {
+		perror("Error opening LOD file");
+		return -2;
+	}
+	lod->file = file;
+	lod->dlm = dlm ? dlm : ",";
+	lod->units = &fda_metric_units;
+	fprintf(lod->fdf, "SESSION%sLEVEL%sBUCKETS%sOFFSET%sFILE\n",
+		lod->dlm, lod->dlm, lod->dlm, lod->dlm);
+	return 0;
+}
+
+/**
+ * File of level 'k': "<file>.L<k>" before the extension of the index
+ */
+static void level_name(char *name, size_t size, const char *file, int k) {
+	const char *ext = strrchr(file, '.');
+	if(!ext || strchr(ext, '/'))
+		ext = file+strlen(file);
+	snprintf(name, size, "%.*s.L%d%s", (int)(ext-file), file, k, ext);
+}
+
+/**
+ * Merge bucket 'b' into accumulator 'acc'
+ */
+static void merge_bucket(struct fda_lod_bucket *acc, const struct fda_lod_bucket *b) {
+	if(!acc->count) {
+		*acc = *b;
+		return;
+	}
+	if(b->alt_min < acc->alt_min) acc->alt_min = b->alt_min;
+	if(b->alt_max > acc->alt_max) acc->alt_max = b->alt_max;
+	if(b->press_min < acc->press_min) acc->press_min = b->press_min;
+	if(b->press_max > acc->press_max) acc->press_max = b->press_max;
+	acc->alt_sum += b->alt_sum;
+	acc->press_sum += b->press_sum;
+	acc->count += b->count;
+}
+
+/**
+ * Write the accumulator of level 'k' to the file of that level.
+ * Level files hold small rows at a slow pace, so they keep the default
+ * stdio buffers: up to FDA_LOD_LEVELS of them may be open at once.
+ */
+static int push_bucket(struct fda_lod *lod, int k) {
+	struct fda_lod_level *level = &lod->levels[k];
+	const struct fda_lod_bucket *b = &level->acc;
+	const char *dlm = lod->dlm;
+	char name[FILENAME_MAX];
+	int r;
+
+	if(!level->fdf) {
+		level_name(name, sizeof(name), lod->file, k);
+		level->fdf = fopen(name, "w");
+		if(!level->fdf) {
+			perror("Error opening LOD level file");
+			return -2;
+		}
+		r = fprintf(level->fdf, "SESSION%sLEVEL%sBUCKET%sTIME%sALT_MIN%sALT_MAX%sALT_MEAN%sPRESS_MIN%sPRESS_MAX%sPRESS_MEAN\n",
+			dlm, dlm, dlm, dlm, dlm, dlm, dlm, dlm, dlm);
+		level->bytes = r > 0 ? r : 0;
+	}
+	if(!level->n)
+		level->start = level->bytes;
+	r = fprintf(level->fdf, "%d%s%d%s%d%s%.3f%s%.2f%s%.2f%s%.2f%s%.2f%s%.2f%s%.2f\n",
+		lod->session, dlm, k, dlm, level->n, dlm, b->ts, dlm,
+		(*lod->units->f_height)(b->alt_min), dlm, (*lod->units->f_height)(b->alt_max), dlm,
+		(*lod->units->f_height)(b->alt_sum/b->count), dlm,
+		(*lod->units->f_pressure)(b->press_min), dlm, (*lod->units->f_pressure)(b->press_max), dlm,
+		(*lod->units->f_pressure)(b->press_sum/b->count));
+	if(r < 0) {
+		print_msg("Error writing LOD level %d\n", k);
+		return -4;
+	}
+	level->bytes += r;
+	level->n++;
+	level->acc.count = 0;
+	return 0;
+}
+
+static int write_session(struct fda_lod *lod) {
+	char name[FILENAME_MAX];
+	const char *dlm = lod->dlm;
+	int k, top, retval;
+
+	/* complete partial buckets, bottom up, until a single bucket covers the session */
+	for(top = 1; top < FDA_LOD_LEVELS; top++) {
+		struct fda_lod_level *level = &lod->levels[top];
+		if(level->acc.count) {
+			merge_bucket(&lod->levels[top+1].acc, &level->acc);
+			if((retval = push_bucket(lod, top)))
+				return retval;
+		}
+		if(level->n <= 1)
+			break;
+	}
+
+	/* coarsest level first, viewers pick the one that fits the screen */
+	for(k = top; k >= 1; k--) {
+		if(!lod->levels[k].n)
+			continue;
+		level_name(name, sizeof(name), lod->file, k);
+		fprintf(lod->fdf, "%d%s%d%s%d%s%lld%s%s\n", lod->session, dlm, k, dlm,
+			lod->levels[k].n, dlm, lod->levels[k].start, dlm, name);
+	}
+	return 0;
+}
+
+int fda_lod_block(void *ctx, int event, struct fda_block *blk) {
+	struct fda_lod *lod = (struct fda_lod *)ctx;
+	struct fda_lod_bucket s;
+	int i, k, retval;
+
+	switch(event) {
+	case FDA_SESSION_START:
+		lod->session = blk->session;
+		for(k = 0; k <= FDA_LOD_LEVELS; k++) {
+			lod->levels[k].n = 0;
+			lod->levels[k].acc.count = 0;
+		}
+		break;
+	case FDA_SAMPLES:
+		for(i = 0; i < blk->n; i++) {
+			s.ts = blk->ts[i];
+			s.alt_min = s.alt_max = s.alt_sum = blk->altitude[i];
+			s.press_min = s.press_max = s.press_sum = blk->pressure[i];
+			s.count = 1;
+			/* a bucket of level k is complete after two buckets of level k-1 */
+			merge_bucket(&lod->levels[1].acc, &s);
+			for(k = 1; k < FDA_LOD_LEVELS && lod->levels[k].acc.count == 1<<k; k++) {
+				merge_bucket(&lod->levels[k+1].acc, &lod->levels[k].acc);
+				if((retval = push_bucket(lod, k)))
+					return retval;
+			}
+		}
+		break;
+	case FDA_SESSION_END:
+		return write_session(lod);
+	}
+	return 0;
+}
+
+int fda_lod_close(struct fda_lod *lod) {
+	int k, retval = 0;
+	for(k = 0; k <= FDA_LOD_LEVELS; k++) {
+		if(!lod->levels[k].fdf)
+			continue;
+		/* write errors stick to the stream, fclose() only reports the last flush */
+		if(ferror(lod->levels[k].fdf) | fclose(lod->levels[k].fdf))
+			retval = -1;
+		lod->levels[k].fdf = NULL;
+	}
+	if(fda_close_output(lod->fdf))
+		retval = -1;
+	return retval;
+}
@@ -0,0 +1,248 @@
+/**
+ * fda-downloader - Simple reader for FlyDream Altimeter or Hobbyking Altimeter
+ *
+ * Copyright (C) 2017  OLopes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include "fda-downloader.h"
+
+#if defined(__unix__)
+#include <pthread.h>
+#endif
+
+/*
+ * Blocks are never given back to the system while the budget allows it:
+ * freed blocks wait in a list per size class until a block of the same
+ * class is asked for again. Once every kind of file went through the
+ * pipeline once, converting more files needs no new memory.
+ */
+
+/* classes are 2^k and 1.5*2^k bytes, from FDA_MEM_MIN up */
+#define FDA_MEM_MIN     32
+#define FDA_MEM_CLASSES 96
+
+struct mem_block {
+	struct mem_block *next;     /* free list, while cached */
+	size_t cls;
+};
+
+/* keeps the user part of a block aligned like malloc() does */
+#define FDA_MEM_HEADER ((sizeof(struct mem_block)+15) & ~(size_t)15)
+
+static struct mem_block *cache[FDA_MEM_CLASSES];
+static struct fda_mem_stats stats;
+/* bytes of the blocks in 'cache' */
+static size_t cached;
+
+/* only bookkeeping under the lock, malloc() and free() run outside of it */
+#if defined(__unix__)
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+#define MEM_LOCK()   pthread_mutex_lock(&mem_lock)
+#define MEM_UNLOCK() pthread_mutex_unlock(&mem_lock)
+#else
+/* no worker threads without pthreads */
+#define MEM_LOCK()
+#define MEM_UNLOCK()
+#endif
+
+static size_t class_size(size_t cls) {
+	size_t base = (size_t)FDA_MEM_MIN << cls/2;
+	return cls & 1 ? base + base/2 : base;
+}
+
+/**
+ * Smallest class holding 'size' bytes, FDA_MEM_CLASSES if none does
+ */
+static size_t size_class(size_t size) {
+	size_t cls;
+	for(cls = 0; cls < FDA_MEM_CLASSES; cls++) {
+		/* stop before class sizes overflow */
+		if(class_size(cls) >= size || class_size(cls) > ((size_t)-1)/4)
+			break;
+	}
+	return class_size(cls) >= size ? cls : FDA_MEM_CLASSES;
+}
+
+/**
+ * Make room for 'bytes' more within the limit, taking cached blocks out,
+ * largest first, into 'release' for the caller to free. Nothing is taken
+ * if that's not enough. Called with the lock held.
+ */
+static int fits(size_t bytes, struct mem_block **release) {
+	struct mem_block *b;
+	size_t cls;
+
+	if(!stats.limit || stats.held + bytes <= stats.limit)
+		return 1;
+	if(stats.held - cached + bytes > stats.limit)
+		return 0;
+	for(cls = FDA_MEM_CLASSES; cls-- > 0 && stats.held + bytes > stats.limit; ) {
+		while((b = cache[cls]) && stats.held + bytes > stats.limit) {
+			cache[cls] = b->next;
+			cached -= FDA_MEM_HEADER + class_size(cls);
+			stats.held -= FDA_MEM_HEADER + class_size(cls);
+			b->next = *release;
+			*release = b;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Give blocks taken out by fits() back to the system
+ */
+static void release_blocks(struct mem_block *b) {
+	struct mem_block *next;
+	for(; b; b = next) {
+		next = b->next;
+		free(b);
+	}
+}
+
+void *fda_malloc(size_t size) {
+	size_t cls = size_class(size), bytes;
+	struct mem_block *b, *release = NULL;
+	int reserved = 0;
+
+	if(cls == FDA_MEM_CLASSES)
+		return NULL;
+	bytes = FDA_MEM_HEADER + class_size(cls);
+	MEM_LOCK();
+	stats.requests++;
+	b = cache[cls];
+	if(b) {
+		cache[cls] = b->next;
+		cached -= bytes;
+	} else if(fits(bytes, &release)) {
+		/* count the block now so concurrent callers see the budget taken */
+		reserved = 1;
+		stats.held += bytes;
+		if(stats.held > stats.peak)
+			stats.peak = stats.held;
+	}
+	MEM_UNLOCK();
+	release_blocks(release);
+	if(reserved) {
+		b = (struct mem_block *) malloc(bytes);
+		MEM_LOCK();
+		if(b)
+			stats.allocations++;
+		else
+			stats.held -= bytes;
+		MEM_UNLOCK();
+		if(b)
+			b->cls = cls;
+	}
+	if(!b) {
+		print_msg("Can't allocate %lu bytes within the memory limit\n", (unsigned long)size);
+		return NULL;
+	}
+	return (char *)b + FDA_MEM_HEADER;
+}
+
+void *fda_calloc(size_t n, size_t size) {
+	void *ptr;
+	if(size && n > ((size_t)-1)/size)
+		return NULL;
+	ptr = fda_malloc(n*size);
+	if(ptr)
+		memset(ptr, 0, n*size);
+	return ptr;
+}
+
+void *fda_realloc(void *ptr, size_t size) {
+	struct mem_block *b;
+	void *p;
+
+	if(!ptr)
+		return fda_malloc(size);
+	b = (struct mem_block *)((char *)ptr - FDA_MEM_HEADER);
+	/* still fits, nothing to do */
+	if(class_size(b->cls) >= size)
+		return ptr;
+	p = fda_malloc(size);
+	if(p) {
+		memcpy(p, ptr, class_size(b->cls));
+		fda_free(ptr);
+	}
+	return p;
+}
+
+void fda_free(void *ptr) {
+	struct mem_block *b;
+	if(!ptr)
+		return;
+	b = (struct mem_block *)((char *)ptr - FDA_MEM_HEADER);
+	MEM_LOCK();
+	b->next = cache[b->cls];
+	cache[b->cls] = b;
+	cached += FDA_MEM_HEADER + class_size(b->cls);
+	MEM_UNLOCK();
+}
+
+int fda_mem_limit(const char *spec) {
+	char *end;
+	unsigned long long n;
+	int shift = 0;
+
+	/* strtoull() would take "-1" as a huge value */
+	if(!isdigit((unsigned char)*spec))
+		return 1;
+	errno = 0;
+	n = strtoull(spec, &end, 10);
+	if(errno == ERANGE)
+		return 1;
+	switch(*end) {
+	case 'G': case 'g':
+		shift += 10;
+		/* no break */
+	case 'M': case 'm':
+		shift += 10;
+		/* no break */
+	case 'K': case 'k':
+		shift += 10;
+		end++;
+		break;
+	}
+	/* the limit must fit a size_t once scaled */
+	if(*end || n == 0 || n > ((size_t)-1) >> shift)
+		return 1;
+	n <<= shift;
+	MEM_LOCK();
+	stats.limit = (size_t)n;
+	MEM_UNLOCK();
+	return 0;
+}
+
+void fda_mem_stats(struct fda_mem_stats *s) {
+	MEM_LOCK();
+	*s = stats;
+	MEM_UNLOCK();
+}
+
+void fda_mem_report(const char *when) {
+	static unsigned long last;
+	struct fda_mem_stats s;
+
+	fda_mem_stats(&s);
+	print_msg("Memory use (%s): %lu requests, %lu allocations (%lu new), %lu bytes held, %lu peak\n",
+		when, s.requests, s.allocations, s.allocations-last, (unsigned long)s.held, (unsigned long)s.peak);
+	last = s.allocations;
+}
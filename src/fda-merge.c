@@ -0,0 +1,250 @@
+/**
+ * fda-downloader - Simple reader for FlyDream Altimeter or Hobbyking Altimeter
+ *
+ * Copyright (C) 2017  OLopes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fda-downloader.h"
+#include "fda-pipeline.h"
+
+/* highest sample rate exponent used to align timestamps (2^20 Hz) */
+#define FDA_MERGE_MAX_SHIFT 20
+
+/**
+ * One altimeter log, read sample by sample
+ */
+struct merge_input {
+	FILE *fdf;
+	const char *file;
+	int remaining;      /* bytes left according to the header */
+	int shift;          /* session sample rate is 2^shift Hz */
+	int in_session;
+	int has_next, has_prev;
+	long idx;           /* index of 'next' in the session */
+	long long tick;     /* 'next' timestamp in merge ticks */
+	/* next unconsumed sample and the last consumed one */
+	double next_ts, next_p, next_t, next_h;
+	double prev_ts, prev_p, prev_t, prev_h;
+};
+
+/**
+ * Read next raw record. Returns 0 at end of input.
+ */
+static int read_record(struct merge_input *in, unsigned char *rec) {
+	if(in->remaining < FDA_SAMPLE_SIZE || fread(rec, 1, FDA_SAMPLE_SIZE, in->fdf) != FDA_SAMPLE_SIZE)
+		return 0;
+	in->remaining -= FDA_SAMPLE_SIZE;
+	return 1;
+}
+
+static int is_marker(const unsigned char *rec) {
+	return rec[0] == 0xff && rec[1] == 0xff && rec[2] == 0xff && rec[3] == 0xff;
+}
+
+/**
+ * Load the next sample of the current session into 'next'
+ */
+static void advance(struct merge_input *in) {
+	unsigned char rec[FDA_SAMPLE_SIZE];
+	long pressure;
+	in->has_next = 0;
+	if(!in->in_session)
+		return;
+	if(!read_record(in, rec) || is_marker(rec)) {
+		in->in_session = 0;
+		return;
+	}
+	pressure = (long)rec[1]<<16 | rec[2]<<8 | rec[3];
+	in->next_ts = in->idx / (double)(1L << in->shift);
+	in->next_p = pressure;
+	in->next_t = rec[0];
+	in->next_h = calc_altitude(pressure, rec[0]);
+	in->has_next = 1;
+}
+
+/**
+ * Skip to the start of the next session. Returns 0 if there is none.
+ */
+static int next_session(struct merge_input *in) {
+	unsigned char rec[FDA_SAMPLE_SIZE];
+	/* drop what is left of the current session */
+	while(in->in_session) {
+		if(!read_record(in, rec) || is_marker(rec))
+			in->in_session = 0;
+	}
+	do {
+		if(!read_record(in, rec))
+			return 0;
+	} while(is_marker(rec));
+	/* first record of a session holds the sample rate */
+	in->shift = rec[3] > FDA_MERGE_MAX_SHIFT ? FDA_MERGE_MAX_SHIFT : rec[3];
+	in->in_session = 1;
+	in->has_prev = 0;
+	in->idx = 0;
+	advance(in);
+	return 1;
+}
+
+/* binary min heap of inputs, ordered by tick of their next sample */
+static void heap_push(struct merge_input **heap, int *n, struct merge_input *in) {
+	int i = (*n)++, parent;
+	while(i > 0 && heap[parent = (i-1)/2]->tick > in->tick) {
+		heap[i] = heap[parent];
+		i = parent;
+	}
+	heap[i] = in;
+}
+
+static struct merge_input *heap_pop(struct merge_input **heap, int *n) {
+	struct merge_input *top = heap[0], *last = heap[--(*n)];
+	int i = 0, child;
+	while((child = 2*i+1) < *n) {
+		if(child+1 < *n && heap[child+1]->tick < heap[child]->tick)
+			child++;
+		if(heap[child]->tick >= last->tick)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	if(*n > 0)
+		heap[i] = last;
+	return top;
+}
+
+static void write_value(FILE *out, const char *dlm, double v) {
+	fprintf(out, "%s%.2f", dlm, v);
+}
+
+int fda_merge(FILE *out, const char **files, int count, const char *dlm,
+		const struct fda_units *units, int interpolate) {
+	unsigned char header[FDA_HEADER_SIZE+FDA_SAMPLE_SIZE];
+	struct merge_input *inputs, **heap, *in;
+	int i, n, active, session = 0, retval = 0, max_shift;
+	long long tick;
+	double w;
+	char *hit;
+
+	inputs = (struct merge_input *) fda_calloc(count, sizeof(struct merge_input));
+	heap = (struct merge_input **) fda_calloc(count, sizeof(struct merge_input *));
+	hit = (char *) fda_calloc(count, 1);
+	if(!inputs || !heap || !hit) {
+		print_msg("Not enough memory to merge %d files\n", count);
+		retval = -1;
+		goto out;
+	}
+
+	for(i = 0; i < count; i++) {
+		in = &inputs[i];
+		in->file = files[i];
+		in->fdf = fopen(files[i], "rb");
+		if(!in->fdf) {
+			perror(files[i]);
+			retval = -2;
+			goto out;
+		}
+		if(fread(header, 1, sizeof(header), in->fdf) != sizeof(header) || !fda_valid_header(header)) {
+			print_msg("Invalid signature header found in %s\n", files[i]);
+			retval = -3;
+			goto out;
+		}
+		in->remaining = fda_data_size(header) - sizeof(header);
+	}
+
+	while(1) {
+		/* line sessions up: n-th session of every unit starts at t=0 */
+		active = 0;
+		max_shift = 0;
+		for(i = 0; i < count; i++) {
+			if(next_session(&inputs[i])) {
+				active++;
+				if(inputs[i].shift > max_shift)
+					max_shift = inputs[i].shift;
+			}
+		}
+		if(!active)
+			break;
+		session++;
+		print_msg("Merging session %d from %d units\n", session, active);
+
+		if(session > 1)
+			fprintf(out, "\n");
+		fprintf(out, "TIME");
+		for(i = 1; i <= count; i++)
+			fprintf(out, "%sPRESSURE_%d%sTEMPERATURE_%d%sALTITUDE_%d", dlm, i, dlm, i, dlm, i);
+		fprintf(out, "\n");
+
+		/* timestamps in ticks of the fastest unit are exact integers */
+		n = 0;
+		for(i = 0; i < count; i++) {
+			in = &inputs[i];
+			if(in->has_next) {
+				in->tick = in->idx << (max_shift - in->shift);
+				heap_push(heap, &n, in);
+			}
+		}
+
+		while(n > 0) {
+			tick = heap[0]->tick;
+			memset(hit, 0, count);
+			/* consume every unit with a sample at this time */
+			while(n > 0 && heap[0]->tick == tick) {
+				in = heap_pop(heap, &n);
+				hit[in - inputs] = 1;
+				in->prev_ts = in->next_ts;
+				in->prev_p = in->next_p;
+				in->prev_t = in->next_t;
+				in->prev_h = in->next_h;
+				in->has_prev = 1;
+				in->idx++;
+				advance(in);
+				if(in->has_next) {
+					in->tick = in->idx << (max_shift - in->shift);
+					heap_push(heap, &n, in);
+				}
+			}
+
+			fprintf(out, "%.3f", tick / (double)(1L << max_shift));
+			for(i = 0; i < count; i++) {
+				in = &inputs[i];
+				if(hit[i]) {
+					write_value(out, dlm, (*units->f_pressure)(in->prev_p));
+					write_value(out, dlm, (*units->f_temperature)(in->prev_t));
+					write_value(out, dlm, (*units->f_height)(in->prev_h));
+				} else if(interpolate && in->has_prev && in->has_next) {
+					/* linear interpolation between the samples around this time */
+					w = (tick / (double)(1L << max_shift) - in->prev_ts) / (in->next_ts - in->prev_ts);
+					write_value(out, dlm, (*units->f_pressure)(in->prev_p + w*(in->next_p - in->prev_p)));
+					write_value(out, dlm, (*units->f_temperature)(in->prev_t + w*(in->next_t - in->prev_t)));
+					write_value(out, dlm, (*units->f_height)(in->prev_h + w*(in->next_h - in->prev_h)));
+				} else {
+					fprintf(out, "%s%s%s", dlm, dlm, dlm);
+				}
+			}
+			fprintf(out, "\n");
+		}
+	}
+
+out:
+	for(i = 0; inputs && i < count; i++)
+		if(inputs[i].fdf)
+			fclose(inputs[i].fdf);
+	fda_free(inputs);
+	fda_free(heap);
+	fda_free(hit);
+	return retval;
+}
@@ -0,0 +1,390 @@
+/**
+ * fda-downloader - Simple reader for FlyDream Altimeter or Hobbyking Altimeter
+ *
+ * Copyright (C) 2017  OLopes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "fda-downloader.h"
+#include "fda-pipeline.h"
+
+/** UNIT CONVERSION FUNCTIONS */
+
+/**
+ * Identity function: returns the same value as the parameter
+ */
+static double identity(double h) {
+	return h;
+}
+
+/**
+ * Convert meters to feets
+ */
+static double m_to_ft(double h) {
+	// 1 m = 3.28 ft
+	return h*3.28;
+}
+
+/**
+ * Convert degree Celsius to Fahrenheit
+ */
+static double c_to_F(double t) {
+	// multiply by 1.8 (or 9/5) and add 32
+	return t*9/5+32;
+}
+
+/**
+ * Convert Pascal to PSI (Pound Square Inch)
+ */
+static double pa_to_psi(double p) {
+	// psi equals to 6894.75729 Pa.
+	return p/6894.75729;
+}
+
+const struct fda_units fda_metric_units = { &identity, &identity, &identity };
+const struct fda_units fda_imperial_units = { &pa_to_psi, &c_to_F, &m_to_ft };
+
+/* stdout and stdio output buffer size */
+#define FDA_OUTPUT_BUF_SIZE (256*1024)
+/* stdio outputs open at the same time with a buffer of ours */
+#define FDA_OUTPUT_MAX_OPEN 64
+/* average fixed point DLM line, longer ones flush the buffer earlier */
+#define FDA_DLM_FIXED_LINE 64
+/* longest NDJSON sample line */
+#define FDA_NDJSON_LINE 192
+/* longest derived field: name and a %.2f double */
+#define FDA_NDJSON_FIELD 360
+
+
+static int io_mode = FDA_IO_AUTO;
+
+/*
+ * stdio buffers come from fda_malloc(), so they count against the memory
+ * limit and are reused by the next file. Slots are claimed atomically,
+ * split session workers open outputs at the same time.
+ */
+static struct {
+	FILE *fdf;
+	char *buf;
+} stdio_bufs[FDA_OUTPUT_MAX_OPEN];
+static char *stdout_buf;
+
+int fda_output_io(const char *name) {
+	if(!strcmp(name, "auto"))
+		io_mode = FDA_IO_AUTO;
+	else if(!strcmp(name, "uring"))
+		io_mode = FDA_IO_URING;
+	else if(!strcmp(name, "thread"))
+		io_mode = FDA_IO_THREAD;
+	else if(!strcmp(name, "stdio"))
+		io_mode = FDA_IO_STDIO;
+	else
+		return 1;
+	return 0;
+}
+
+FILE *fda_open_output(const char *file, const char *mode) {
+	FILE *fdf;
+	char *buf;
+	int i;
+	if(!strcmp(file, "-")) {
+		/* large blocks, downstream tools don't need every line right away */
+		if(!stdout_buf) {
+			stdout_buf = (char *) fda_malloc(FDA_OUTPUT_BUF_SIZE);
+			setvbuf(stdout, stdout_buf, _IOFBF, FDA_OUTPUT_BUF_SIZE);
+		}
+		return stdout;
+	}
+	/* format and write at the same time */
+	if(io_mode != FDA_IO_STDIO && (fdf = fda_writer_open(file, io_mode)))
+		return fdf;
+	fdf = fopen(file, mode);
+	if(fdf && (buf = (char *) fda_malloc(FDA_OUTPUT_BUF_SIZE))) {
+		for(i = 0; i < FDA_OUTPUT_MAX_OPEN; i++) {
+			FILE *none = NULL;
+			if(__atomic_compare_exchange_n(&stdio_bufs[i].fdf, &none, fdf, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				stdio_bufs[i].buf = buf;
+				setvbuf(fdf, buf, _IOFBF, FDA_OUTPUT_BUF_SIZE);
+				return fdf;
+			}
+		}
+		/* no free slot, stdio uses its own buffer */
+		fda_free(buf);
+	}
+	return fdf;
+}
+
+int fda_close_output(FILE *fdf) {
+	int i, retval;
+	if(fdf == stdout)
+		return fflush(fdf);
+	/* before fclose(), a new FILE may get the same address */
+	for(i = 0; i < FDA_OUTPUT_MAX_OPEN; i++) {
+		if(__atomic_load_n(&stdio_bufs[i].fdf, __ATOMIC_RELAXED) == fdf)
+			break;
+	}
+	retval = fclose(fdf);
+	if(i < FDA_OUTPUT_MAX_OPEN) {
+		fda_free(stdio_bufs[i].buf);
+		__atomic_store_n(&stdio_bufs[i].fdf, NULL, __ATOMIC_RELEASE);
+	}
+	return retval;
+}
+
+int fda_write_fda(FILE *fdf, const unsigned char *data, int size) {
+	int n, w;
+
+	n = 0;
+	while( n < size ) {
+		w = fwrite(data+n, sizeof(unsigned char), size-n, fdf);
+		if(w <= 0) {
+			print_msg("Error writing FDA data (%d)\n", w);
+			return -3;
+		}
+		/* update counters and pointers */
+		n += w;
+	}
+	return 0;
+}
+
+int fda_dlm_block(void *ctx, int event, struct fda_block *blk) {
+	struct fda_text_output *out = (struct fda_text_output *)ctx;
+	const struct fda_units *units = out->units;
+	FILE *fdf = out->fdf;
+	const char *dlm = out->dlm;
+	struct fda_query_eval *query = out->query;
+	double press_conv, temp_conv, alti_conv;
+	int i, j, kept;
+
+	switch(event) {
+	case FDA_SESSION_START:
+		fprintf(fdf, "TIME%sPRESSURE%sTEMPERATURE%sALTITUDE",dlm,dlm,dlm);
+		if(out->smooth)
+			fprintf(fdf, "%sSMOOTH_ALTITUDE",dlm);
+		if(query) {
+			for(j = 0; j < query->query->n_expr; j++)
+				fprintf(fdf, "%s%s",dlm,query->query->names[j]);
+			fda_query_session(query);
+		}
+		fprintf(fdf, "\n");
+		print_msg("First record, output header line. freq=%d; tIncr=%.3f\n", blk->freq, 1.0/blk->freq);
+		break;
+	case FDA_SAMPLES:
+		kept = query ? fda_query_block(query, blk) : blk->n;
+		for(i = 0; i < blk->n; i++) {
+			if(query && !query->keep[i])
+				continue;
+			press_conv=(*units->f_pressure)(blk->pressure[i]);
+			temp_conv=(*units->f_temperature)(blk->temperature[i]);
+			alti_conv=(*units->f_height)(blk->altitude[i]);
+			fprintf(fdf, "%.3f%s%.2f%s%.2f%s%.2f",blk->ts[i],dlm,press_conv,dlm,temp_conv,dlm,alti_conv);
+			if(out->smooth)
+				fprintf(fdf, "%s%.2f",dlm,(*units->f_height)(blk->smooth[i]));
+			for(j = 0; query && j < query->query->n_expr; j++)
+				fprintf(fdf, "%s%.2f",dlm,query->values[j][i]);
+			fprintf(fdf, "\n");
+
+			// debug message
+			print_msg("Regular record, output record line. ts=%.3f; pressure=%ld (%.2f) ; temperature=%hd (%.2f); altitude=%.2f (%.2f)\n",blk->ts[i],blk->pressure[i],press_conv,blk->temperature[i],temp_conv,blk->altitude[i],alti_conv);
+		}
+		out->samples += kept;
+		break;
+	case FDA_SESSION_END:
+		if(blk->closed) {
+			fprintf(fdf, "\n");
+			print_msg("Empty sample, output an empty line\n");
+		}
+		break;
+	}
+	return 0;
+}
+
+/**
+ * Write 'v' / 10^decimals in decimal, integer arithmetic only
+ */
+static char *put_fixed(char *p, long long v, int decimals) {
+	char digits[24];
+	unsigned long long u = v < 0 ? -(unsigned long long)v : (unsigned long long)v;
+	int n = 0;
+	do {
+		digits[n++] = '0' + u % 10;
+		u /= 10;
+	} while(u || n <= decimals);
+	if(v < 0)
+		*p++ = '-';
+	while(n > 0) {
+		if(n-- == decimals)
+			*p++ = '.';
+		*p++ = digits[n];
+	}
+	return p;
+}
+
+/**
+ * Round num/den half away from zero
+ */
+static long long div_round(long long num, long long den) {
+	return (num >= 0 ? num + den/2 : num - den/2) / den;
+}
+
+int fda_dlm_fixed_block(void *ctx, int event, struct fda_block *blk) {
+	struct fda_text_output *out = (struct fda_text_output *)ctx;
+	int imperial = out->units == &fda_imperial_units;
+	char buf[FDA_BLOCK_SIZE*FDA_DLM_FIXED_LINE], *p = buf;
+	size_t dlm_len = strlen(out->dlm);
+	/* three delimiters and four numbers */
+	size_t line = 3*dlm_len + 4*24 + 1;
+	long long press, temp, alti, den;
+	int i;
+
+	if(event != FDA_SAMPLES)
+		return fda_dlm_block(ctx, event, blk);
+	if(line > sizeof(buf))
+		return -5;
+	for(i = 0; i < blk->n; i++) {
+		if(buf+sizeof(buf)-p < line) {
+			fwrite(buf, 1, p-buf, out->fdf);
+			p = buf;
+		}
+		/* hundredths of the output unit, as the %.2f of fda_dlm_block() */
+		if(imperial) {
+			press = div_round(blk->pressure[i]*10000000LL, 689475729LL);
+			temp = blk->temperature[i]*180LL + 3200;
+			/* 3.28 ft per metre, as m_to_ft(), rounded once */
+			alti = fda_altitude_frac(blk->pressure[i], &den)*328LL;
+			alti = div_round(alti, den);
+		} else {
+			press = blk->pressure[i]*100LL;
+			temp = blk->temperature[i]*100LL;
+			alti = blk->altitude_cm[i];
+		}
+		p = put_fixed(p, div_round(blk->index[i]*1000LL, blk->freq), 3);
+		memcpy(p, out->dlm, dlm_len);
+		p = put_fixed(p+dlm_len, press, 2);
+		memcpy(p, out->dlm, dlm_len);
+		p = put_fixed(p+dlm_len, temp, 2);
+		memcpy(p, out->dlm, dlm_len);
+		p = put_fixed(p+dlm_len, alti, 2);
+		*p++ = '\n';
+	}
+	fwrite(buf, 1, p-buf, out->fdf);
+	out->samples += blk->n;
+	return 0;
+}
+
+int fda_write_dlm(FILE *fdf, const unsigned char *data, int size, const char *dlm,
+		const struct fda_units *units, struct fda_filter *filter) {
+	struct fda_decoder dec;
+	struct fda_text_output out;
+	int retval;
+
+	out.fdf = fdf;
+	out.dlm = dlm;
+	out.units = units;
+	out.smooth = filter != NULL;
+	out.samples = 0;
+	out.query = NULL;
+	dec.filter = filter;
+	dec.fixed = 0;
+	dec.cb = &fda_dlm_block;
+	dec.ctx = &out;
+	retval = fda_decode(&dec, data, size);
+
+	print_msg("Output complete. %d samples written.\n", out.samples);
+	return retval;
+}
+
+int fda_fanout_block(void *ctx, int event, struct fda_block *blk) {
+	struct fda_fanout *fanout = (struct fda_fanout *)ctx;
+	int i, retval;
+	for(i = 0; i < fanout->n; i++) {
+		if((retval = (*fanout->cb[i])(fanout->ctx[i], event, blk)))
+			return retval;
+	}
+	return 0;
+}
+
+int fda_ndjson_block(void *ctx, int event, struct fda_block *blk) {
+	struct fda_text_output *out = (struct fda_text_output *)ctx;
+	const struct fda_units *units = out->units;
+	/* a block is formatted in memory and written at once */
+	char buf[FDA_BLOCK_SIZE*FDA_NDJSON_LINE], *p = buf, *end = buf+sizeof(buf);
+	struct fda_query_eval *query = out->query;
+	int i, j, kept;
+
+	switch(event) {
+	case FDA_SESSION_START:
+		if(query)
+			fda_query_session(query);
+		fprintf(out->fdf, "{\"type\":\"session\",\"session\":%d,\"rate\":%d,\"units\":\"%s\"}\n",
+			blk->session, blk->freq, units == &fda_imperial_units ? "imperial" : "metric");
+		break;
+	case FDA_SAMPLES:
+		kept = query ? fda_query_block(query, blk) : blk->n;
+		for(i = 0; i < blk->n; i++) {
+			if(query && !query->keep[i])
+				continue;
+			if(query && end-p < FDA_NDJSON_LINE+query->query->n_expr*FDA_NDJSON_FIELD) {
+				fwrite(buf, 1, p-buf, out->fdf);
+				p = buf;
+			}
+			p += snprintf(p, end-p, "{\"type\":\"sample\",\"session\":%d,\"time\":%.3f,\"pressure\":%.2f,\"temperature\":%.2f,\"altitude\":%.2f",
+				blk->session, blk->ts[i], (*units->f_pressure)(blk->pressure[i]),
+				(*units->f_temperature)(blk->temperature[i]), (*units->f_height)(blk->altitude[i]));
+			if(out->smooth)
+				p += snprintf(p, end-p, ",\"smooth_altitude\":%.2f", (*units->f_height)(blk->smooth[i]));
+			for(j = 0; query && j < query->query->n_expr; j++) {
+				/* JSON has no NaN or infinity */
+				if(isfinite(query->values[j][i]))
+					p += snprintf(p, end-p, ",\"%s\":%.2f", query->query->names[j], query->values[j][i]);
+				else
+					p += snprintf(p, end-p, ",\"%s\":null", query->query->names[j]);
+			}
+			p += snprintf(p, end-p, "}\n");
+		}
+		fwrite(buf, 1, p-buf, out->fdf);
+		out->samples += kept;
+		break;
+	case FDA_SESSION_END:
+		fprintf(out->fdf, "{\"type\":\"session_end\",\"session\":%d,\"closed\":%s}\n",
+			blk->session, blk->closed ? "true" : "false");
+		break;
+	}
+	return 0;
+}
+
+int fda_write_ndjson(FILE *fdf, const unsigned char *data, int size,
+		const struct fda_units *units, struct fda_filter *filter) {
+	struct fda_decoder dec;
+	struct fda_text_output out;
+	int retval;
+
+	out.fdf = fdf;
+	out.dlm = NULL;
+	out.units = units;
+	out.smooth = filter != NULL;
+	out.samples = 0;
+	out.query = NULL;
+	dec.filter = filter;
+	dec.fixed = 0;
+	dec.cb = &fda_ndjson_block;
+	dec.ctx = &out;
+	retval = fda_decode(&dec, data, size);
+
+	print_msg("Output complete. %d samples written.\n", out.samples);
+	return retval;
+}
@@ -0,0 +1,561 @@
+/**
+ * fda-downloader - Simple reader for FlyDream Altimeter or Hobbyking Altimeter
+ *
+ * Copyright (C) 2017  OLopes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef FDA_PIPELINE_H_
+#define FDA_PIPELINE_H_
+
+#include <stdio.h>
+
+#define FDA_HEADER_SIZE 8
+#define FDA_SAMPLE_SIZE 4
+/* highest sample rate exponent taken from a session header (2^20 Hz),
+ * corrupt rate bytes are clamped to it */
+#define FDA_MAX_RATE_SHIFT 20
+/* number of samples decoded before they are handed to the next stage */
+#define FDA_BLOCK_SIZE 256
+
+/**
+ * Decoded samples of a single session, stored column by column
+ */
+struct fda_block {
+	int session;    /* session number, starting at 1 */
+	int freq;       /* session sample rate in Hz */
+	int closed;     /* session was closed by an end marker (not by EOF) */
+	int n;          /* number of samples in this block */
+	double ts[FDA_BLOCK_SIZE];
+	long pressure[FDA_BLOCK_SIZE];
+	short temperature[FDA_BLOCK_SIZE];
+	double altitude[FDA_BLOCK_SIZE];
+	double smooth[FDA_BLOCK_SIZE];
+	/* fixed point decoding fills these instead of ts and altitude */
+	long index[FDA_BLOCK_SIZE];         /* sample number in session */
+	long altitude_cm[FDA_BLOCK_SIZE];
+};
+
+/**
+ * Events sent by the decoder to the output stage
+ */
+#define FDA_SESSION_START 1
+#define FDA_SAMPLES       2
+#define FDA_SESSION_END   3
+
+/**
+ * Output stage callback. Returns 0 to continue decoding.
+ */
+typedef int (*fda_block_cb)(void *ctx, int event, struct fda_block *blk);
+
+/**
+ * Streaming altitude smoother: constant velocity Kalman filter
+ * over (altitude, vertical speed).
+ */
+struct fda_filter {
+	double q;       /* process noise (acceleration variance, m2/s4) */
+	double r;       /* measurement noise (altitude variance, m2) */
+	double dt;      /* sample period in seconds */
+	double h, v;    /* state: altitude and vertical speed */
+	double p00, p01, p11;   /* state covariance */
+	int primed;     /* first measurement received */
+	/* per block gains, they don't depend on the samples */
+	double k0[FDA_BLOCK_SIZE], k1[FDA_BLOCK_SIZE];
+};
+
+/**
+ * Decoder state: raw buffer in, sample blocks out
+ */
+struct fda_decoder {
+	struct fda_filter *filter;  /* optional smoothing stage */
+	int fixed;                  /* integer only decoding, no filter */
+	fda_block_cb cb;
+	void *ctx;
+	struct fda_block blk;
+	/* position in the raw buffer and current session state */
+	int pos;
+	int st;
+	double ts, tIncr;
+	long index;
+};
+
+/**
+ * Decode 'size' bytes of uploaded data (header included) and feed the
+ * samples to the decoder callback.
+ *
+ * Returns 0 if success or the first non zero value returned by the callback.
+ */
+extern int fda_decode(struct fda_decoder *dec, const unsigned char *data, int size);
+
+/**
+ * Incremental decoding: call fda_decode_start() once, then fda_decode_feed()
+ * every time more bytes are appended to 'data', and fda_decode_finish()
+ * when all data was received. 'size' is the total number of bytes in 'data'.
+ */
+extern void fda_decode_start(struct fda_decoder *dec);
+extern int fda_decode_feed(struct fda_decoder *dec, const unsigned char *data, int size);
+extern int fda_decode_finish(struct fda_decoder *dec);
+
+/**
+ * The first 'n' bytes of 'data' were dropped: next fda_decode_feed()
+ * gets 'data' starting at old offset 'n'. Only complete records decoded
+ * so far can be dropped.
+ */
+extern void fda_decode_shift(struct fda_decoder *dec, int n);
+
+/**
+ * Total upload size (header included) announced by the first
+ * FDA_HEADER_SIZE+FDA_SAMPLE_SIZE bytes of an upload
+ */
+extern int fda_data_size(const unsigned char *header);
+
+/**
+ * Non zero if the first FDA_HEADER_SIZE bytes are the upload signature
+ */
+extern int fda_valid_header(const unsigned char *header);
+
+/**
+ * Store 'total' in an upload header, reverse of fda_data_size()
+ */
+extern void fda_set_data_size(unsigned char *header, int total);
+
+/**
+ * Calculate altitude from pressure and temperature readings (hypsometric equation)
+ */
+extern double calc_altitude(long pressure, short temperature);
+
+/**
+ * Same as calc_altitude() in centimetres, without floating point:
+ * quadratic interpolation over a table every 512 Pa. Within 1 cm of
+ * calc_altitude() between 30 and 120 kPa (~9000 m up to below sea level).
+ */
+extern long fda_altitude_cm(long pressure);
+
+/**
+ * Unrounded fda_altitude_cm(): altitude in metres is the returned value
+ * divided by 'den'. For conversions that round only once.
+ */
+extern long long fda_altitude_frac(long pressure, long long *den);
+
+/**
+ * Parse filter settings in the format "q[:r]". Returns 0 if success.
+ */
+extern int fda_filter_parse(struct fda_filter *f, const char *spec);
+
+/**
+ * Reset filter state at a session boundary
+ */
+extern void fda_filter_reset(struct fda_filter *f, double dt);
+
+/**
+ * Smooth 'n' altitude measurements from 'z' into 'out'
+ */
+extern void fda_filter_block(struct fda_filter *f, const double *z, double *out, int n);
+
+/**
+ * Unit conversion functions applied on output
+ */
+struct fda_units {
+	double (*f_pressure)(double);
+	double (*f_temperature)(double);
+	double (*f_height)(double);
+};
+
+extern const struct fda_units fda_metric_units;
+extern const struct fda_units fda_imperial_units;
+
+/**
+ * Expressions over the decoded columns, compiled once into stack
+ * machine code. Every instruction runs over a whole block of samples.
+ */
+#define FDA_EXPR_CODE  64
+#define FDA_EXPR_STACK 8
+#define FDA_MAX_EXPR   8
+
+struct fda_expr_op {
+	unsigned char op;
+	unsigned char arg;  /* variable loaded by OP_LOAD */
+	double k;           /* constant pushed by OP_CONST */
+};
+
+struct fda_expr {
+	struct fda_expr_op code[FDA_EXPR_CODE];
+	int n;
+	int depth;      /* stack slots needed */
+	int vars;       /* bit set of variables used */
+};
+
+/**
+ * Derived columns (--expr) and row filter (--where)
+ */
+struct fda_query {
+	char names[FDA_MAX_EXPR][32];
+	struct fda_expr expr[FDA_MAX_EXPR];
+	int n_expr;
+	struct fda_expr where;
+	int has_where;
+};
+
+/**
+ * Per output evaluation state and scratch columns
+ */
+struct fda_query_eval {
+	const struct fda_query *query;
+	const struct fda_units *units;
+	int smooth;             /* height variables come from the smoothed column */
+	double launch, prev;    /* first and last height of the session */
+	int primed;
+	double height[FDA_BLOCK_SIZE];
+	double vspeed[FDA_BLOCK_SIZE];
+	double stack[FDA_EXPR_STACK+1][FDA_BLOCK_SIZE];
+	double values[FDA_MAX_EXPR][FDA_BLOCK_SIZE];    /* derived columns */
+	unsigned char keep[FDA_BLOCK_SIZE];             /* rows passing the filter */
+};
+
+/**
+ * Compile 'text'. Variables are time (or ts), pressure, temperature,
+ * altitude, smooth, vspeed, launch, session and rate, in output units.
+ * Returns 0 if success or the position of the error, described by 'err'.
+ */
+extern int fda_expr_compile(struct fda_expr *e, const char *text, const char **err);
+
+/**
+ * Add derived column "name=expression" or set the row filter.
+ * Same return values as fda_expr_compile().
+ */
+extern int fda_query_add(struct fda_query *q, const char *spec, const char **err);
+extern int fda_query_where(struct fda_query *q, const char *text, const char **err);
+
+/**
+ * Allocate evaluation state for one output
+ */
+extern struct fda_query_eval *fda_query_open(const struct fda_query *q,
+		const struct fda_units *units, int smooth);
+extern void fda_query_close(struct fda_query_eval *ev);
+
+/**
+ * Reset session state (launch height, vertical speed)
+ */
+extern void fda_query_session(struct fda_query_eval *ev);
+
+/**
+ * Evaluate derived columns and filter over a block.
+ * Returns the number of rows kept.
+ */
+extern int fda_query_block(struct fda_query_eval *ev, const struct fda_block *blk);
+
+/**
+ * DLM and NDJSON output stages
+ */
+struct fda_text_output {
+	FILE *fdf;
+	const char *dlm;    /* DLM only */
+	const struct fda_units *units;
+	int smooth;     /* add smoothed altitude column */
+	int samples;    /* samples written so far */
+	struct fda_query_eval *query;   /* optional derived columns and filter */
+};
+
+/**
+ * Decoder callback: write samples as delimited text
+ */
+extern int fda_dlm_block(void *ctx, int event, struct fda_block *blk);
+
+/**
+ * Decoder callback: same as fda_dlm_block() for fixed point blocks,
+ * formatted with integer arithmetic only
+ */
+extern int fda_dlm_fixed_block(void *ctx, int event, struct fda_block *blk);
+
+/**
+ * Resampling stage: converts every session to a fixed rate, with a
+ * windowed sinc low pass when decimating. Pressure, temperature,
+ * altitude and smoothed altitude are resampled.
+ */
+#define FDA_RESAMPLE_COLUMNS 4
+
+struct fda_resampler {
+	int rate;           /* output rate in Hz */
+	int smooth;         /* blocks carry smoothed altitude */
+	fda_block_cb cb;    /* next stage */
+	void *ctx;
+	int in_rate;
+	double scale;       /* kernel zero crossings per input sample */
+	double width;       /* kernel half width in input samples */
+	double *hist;       /* input samples still needed, row by row */
+	int n, cap;
+	long base;          /* session index of the first sample in 'hist' */
+	long next;          /* next output sample */
+	double first[FDA_RESAMPLE_COLUMNS], last[FDA_RESAMPLE_COLUMNS];
+	struct fda_block out;
+};
+
+/**
+ * Set up resampling to 'rate' Hz in front of stage 'cb'. Returns 0 if success.
+ */
+extern int fda_resample_open(struct fda_resampler *rs, int rate, int smooth, fda_block_cb cb, void *ctx);
+
+/**
+ * Decoder callback: resample and pass blocks to the next stage
+ */
+extern int fda_resample_block(void *ctx, int event, struct fda_block *blk);
+
+/**
+ * Release history buffer
+ */
+extern void fda_resample_close(struct fda_resampler *rs);
+
+/**
+ * Several output stages fed by the same decoder
+ */
+#define FDA_MAX_SINKS 8
+
+struct fda_fanout {
+	int n;
+	fda_block_cb cb[FDA_MAX_SINKS];
+	void *ctx[FDA_MAX_SINKS];
+};
+
+/**
+ * Decoder callback: hand every event to all stages of a fda_fanout
+ */
+extern int fda_fanout_block(void *ctx, int event, struct fda_block *blk);
+
+/**
+ * Decoder callback: write one JSON object per sample and per session boundary
+ */
+extern int fda_ndjson_block(void *ctx, int event, struct fda_block *blk);
+
+/**
+ * Output backends
+ */
+#define FDA_IO_AUTO   0   /* io_uring if the kernel supports it, else a thread */
+#define FDA_IO_URING  1
+#define FDA_IO_THREAD 2   /* pwrite() from a writer thread */
+#define FDA_IO_STDIO  3   /* plain fopen() */
+
+/**
+ * Select output backend by name. Returns 0 if success.
+ */
+extern int fda_output_io(const char *name);
+
+/**
+ * Open output file, "-" means stdout
+ */
+extern FILE *fda_open_output(const char *file, const char *mode);
+
+/**
+ * Open 'file' for writing with double buffered asynchronous writes.
+ * Returns NULL if the backend is not available on this platform.
+ */
+extern FILE *fda_writer_open(const char *file, int mode);
+
+/**
+ * Close output file opened by fda_open_output()
+ */
+extern int fda_close_output(FILE *fdf);
+
+/**
+ * Write raw FDA/HKA contents. Returns 0 if success.
+ */
+extern int fda_write_fda(FILE *fdf, const unsigned char *data, int size);
+
+/**
+ * Decode raw contents and write them as delimited text. Returns 0 if success.
+ */
+extern int fda_write_dlm(FILE *fdf, const unsigned char *data, int size, const char *dlm,
+		const struct fda_units *units, struct fda_filter *filter);
+
+/**
+ * Merge several FDA/HKA files into one delimited table. The n-th session of
+ * every file is aligned at t=0 and rows are emitted for every timestamp of
+ * any unit. Missing values are left empty or interpolated.
+ */
+extern int fda_merge(FILE *out, const char **files, int count, const char *dlm,
+		const struct fda_units *units, int interpolate);
+
+/**
+ * Task 'i' of a worker pool, run by worker 'worker' (0..workers-1).
+ * Returns 0 if success.
+ */
+typedef int (*fda_task_cb)(void *ctx, int worker, int i);
+
+/**
+ * Run tasks 0..count-1 on up to 'workers' threads (in the calling thread
+ * where there are none). Returns the first non zero task result, tasks
+ * not started yet are skipped once one fails.
+ */
+extern int fda_pool_run(int workers, int count, fda_task_cb task, void *ctx);
+
+/**
+ * Aggregate many FDA/HKA files on 'workers' threads: histograms and
+ * quantiles of apex altitude, duration and temperature per session,
+ * written to 'out' as JSON. Unreadable or damaged files are counted
+ * and skipped.
+ */
+extern int fda_fleet_run(FILE *out, const char **files, int count, int workers);
+
+/**
+ * Serve conversion requests on Unix socket 'path' with a fixed pool of
+ * 'workers' threads. Runs until SIGINT/SIGTERM.
+ */
+extern int fda_server_run(const char *path, int workers, const struct fda_filter *filter);
+
+/**
+ * Decode raw contents and write them as newline delimited JSON
+ */
+extern int fda_write_ndjson(FILE *fdf, const unsigned char *data, int size,
+		const struct fda_units *units, struct fda_filter *filter);
+
+/**
+ * Level of detail sidecar: min/max/mean per bucket of 2^level samples.
+ * Every level goes to its own file, <file> is an index telling where
+ * the buckets of each session and level are.
+ */
+#define FDA_LOD_LEVELS 31
+
+struct fda_lod_bucket {
+	double ts;
+	double alt_min, alt_max, alt_sum;
+	double press_min, press_max, press_sum;
+	int count;
+};
+
+struct fda_lod_level {
+	struct fda_lod_bucket acc;      /* bucket being filled */
+	FILE *fdf;                      /* opened with the first bucket */
+	long long bytes;                /* written to fdf so far */
+	long long start;                /* offset of the current session */
+	int n;                          /* buckets of the current session */
+};
+
+struct fda_lod {
+	FILE *fdf;                      /* index */
+	const char *file;
+	const char *dlm;
+	const struct fda_units *units;
+	int session;
+	struct fda_lod_level levels[FDA_LOD_LEVELS+1];
+};
+
+/**
+ * Open LOD index file. Returns 0 if success.
+ */
+extern int fda_lod_open(struct fda_lod *lod, const char *file, const char *dlm);
+
+/**
+ * Decoder callback: accumulates samples and writes every bucket to the
+ * file of its level as soon as it is complete
+ */
+extern int fda_lod_block(void *ctx, int event, struct fda_block *blk);
+
+/**
+ * Close LOD index and level files
+ */
+extern int fda_lod_close(struct fda_lod *lod);
+
+/**
+ * CRC32C checksums of an upload, for the whole data and for every session
+ * (from its rate header up to and including its end marker)
+ */
+#define FDA_CRC_EXT ".crc"
+
+struct fda_crc_session {
+	int offset, length;
+	unsigned crc;
+};
+
+struct fda_crc {
+	unsigned file;      /* checksum of the first 'pos' bytes */
+	unsigned session;   /* checksum of current session so far */
+	int pos;
+	int rec;            /* next record to scan for session markers */
+	int start;          /* offset of current session */
+	int base;           /* bytes dropped by fda_crc_shift() */
+	struct fda_crc_session *sessions;
+	int n, cap;
+};
+
+/**
+ * CRC32C of 'size' bytes, continuing from 'crc' (0 to start).
+ * Uses the CPU crc32 instructions when available.
+ */
+extern unsigned fda_crc32c(unsigned crc, const unsigned char *data, size_t size);
+
+/**
+ * Incremental checksums: same calling convention as fda_decode_feed(),
+ * 'size' is the number of bytes received so far in 'data'.
+ */
+extern void fda_crc_start(struct fda_crc *crc);
+extern int fda_crc_feed(struct fda_crc *crc, const unsigned char *data, int size);
+extern int fda_crc_finish(struct fda_crc *crc);
+
+/**
+ * Same as fda_decode_shift(). Offsets and sizes saved later still count
+ * from the start of the upload.
+ */
+extern void fda_crc_shift(struct fda_crc *crc, int n);
+
+/**
+ * Checksum a whole buffer at once
+ */
+extern int fda_crc_compute(struct fda_crc *crc, const unsigned char *data, int size);
+
+/**
+ * Release session list
+ */
+extern void fda_crc_free(struct fda_crc *crc);
+
+/**
+ * Write checksums next to 'file' (file name + FDA_CRC_EXT). Returns 0 if success.
+ */
+extern int fda_crc_save(const struct fda_crc *crc, const char *file);
+
+/**
+ * Check 'data' read from 'file' against its checksum file.
+ * Returns 0 if it matches, 1 if there is no checksum file, -1 if it is
+ * invalid and -2 if the data doesn't match.
+ */
+extern int fda_crc_check(const char *file, const unsigned char *data, int size);
+
+/**
+ * Same as fda_crc_check() for checksums computed by the caller,
+ * fda_crc_finish() included. Data doesn't have to be in memory.
+ */
+extern int fda_crc_match(const char *file, const struct fda_crc *crc);
+
+/**
+ * Live sample feed in shared memory (see fda-live.h)
+ */
+struct fda_live {
+	struct fda_live_ring *ring;
+	unsigned long long seq;
+};
+
+/**
+ * Create shared memory feed 'name'. Returns 0 if success.
+ */
+extern int fda_live_open(struct fda_live *live, const char *name);
+
+/**
+ * Decoder callback: publish samples to the feed
+ */
+extern int fda_live_block(void *ctx, int event, struct fda_block *blk);
+
+/**
+ * Mark feed as complete and unmap it
+ */
+extern int fda_live_close(struct fda_live *live);
+
+#endif /* FDA_PIPELINE_H_ */
@@ -0,0 +1,100 @@
+/**
+ * fda-downloader - Simple reader for FlyDream Altimeter or Hobbyking Altimeter
+ *
+ * Copyright (C) 2017  OLopes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "fda-downloader.h"
+#include "fda-pipeline.h"
+
+#if defined(__unix__)
+#include <pthread.h>
+#endif
+
+/**
+ * Shared by all workers of one fda_pool_run() call
+ */
+struct fda_pool {
+	fda_task_cb task;
+	void *ctx;
+	int count;
+	int next;       /* next task to hand out */
+	int error;      /* first non zero task result */
+};
+
+struct fda_pool_worker {
+	struct fda_pool *pool;
+	int id;
+};
+
+/**
+ * Take tasks until there are none left or one failed
+ */
+static void *pool_worker(void *arg) {
+	struct fda_pool *pool = ((struct fda_pool_worker *)arg)->pool;
+	int id = ((struct fda_pool_worker *)arg)->id;
+	int i, retval, none = 0;
+	while(!__atomic_load_n(&pool->error, __ATOMIC_RELAXED)) {
+		i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+		if(i >= pool->count)
+			break;
+		if((retval = (*pool->task)(pool->ctx, id, i)))
+			__atomic_compare_exchange_n(&pool->error, &none, retval, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+int fda_pool_run(int workers, int count, fda_task_cb task, void *ctx) {
+	struct fda_pool pool;
+	struct fda_pool_worker self = { &pool, 0 };
+
+	pool.task = task;
+	pool.ctx = ctx;
+	pool.count = count;
+	pool.next = 0;
+	pool.error = 0;
+	if(workers > count)
+		workers = count;
+
+#if defined(__unix__)
+	if(workers > 1) {
+		pthread_t *threads = (pthread_t *) fda_malloc(workers*sizeof(pthread_t));
+		struct fda_pool_worker *ids = (struct fda_pool_worker *) fda_malloc(workers*sizeof(struct fda_pool_worker));
+		int i, started = 0;
+		if(threads && ids) {
+			for(started = 0; started < workers; started++) {
+				ids[started].pool = &pool;
+				ids[started].id = started;
+				if(pthread_create(&threads[started], NULL, &pool_worker, &ids[started]))
+					break;
+			}
+			/* with no thread at all the caller does the work */
+			if(!started)
+				pool_worker(&self);
+			for(i = 0; i < started; i++)
+				pthread_join(threads[i], NULL);
+			fda_free(threads);
+			fda_free(ids);
+			return pool.error;
+		}
+		fda_free(threads);
+		fda_free(ids);
+	}
+#endif
+	pool_worker(&self);
+	return pool.error;
+}
@@ -0,0 +1,219 @@
+/**
+ * fda-downloader - Simple reader for FlyDream Altimeter or Hobbyking Altimeter
+ *
+ * Copyright (C) 2017  OLopes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "fda-downloader.h"
+#include "fda-pipeline.h"
+
+/* kernel half width, in zero crossings of the lower rate */
+#define FDA_RESAMPLE_ZEROS 8
+/* kernel table steps per zero crossing */
+#define FDA_RESAMPLE_STEPS 256
+/* pass band edge as a fraction of the output Nyquist rate when decimating */
+#define FDA_RESAMPLE_CUTOFF 0.9
+
+/* Blackman windowed sinc, sampled once */
+static double kernel[FDA_RESAMPLE_ZEROS*FDA_RESAMPLE_STEPS+2];
+
+/**
+ * Fill the kernel table before main(), workers only read it
+ */
+#if defined(__GNUC__)
+__attribute__((constructor))
+#endif
+static void kernel_init(void) {
+	const double pi = 3.14159265358979323846;
+	double x, w;
+	int i;
+	kernel[0] = 1.0;
+	for(i = 1; i <= FDA_RESAMPLE_ZEROS*FDA_RESAMPLE_STEPS; i++) {
+		x = (double)i/FDA_RESAMPLE_STEPS;
+		w = 0.42 + 0.5*cos(pi*x/FDA_RESAMPLE_ZEROS) + 0.08*cos(2*pi*x/FDA_RESAMPLE_ZEROS);
+		kernel[i] = sin(pi*x)/(pi*x)*w;
+	}
+	kernel[i] = 0.0;
+}
+
+/**
+ * Kernel at 'x' zero crossings from the centre
+ */
+static double kernel_at(double x) {
+	double pos = fabs(x)*FDA_RESAMPLE_STEPS, f;
+	int i;
+	if(pos >= FDA_RESAMPLE_ZEROS*FDA_RESAMPLE_STEPS)
+		return 0.0;
+	i = (int)pos;
+	f = pos-i;
+	return kernel[i] + f*(kernel[i+1]-kernel[i]);
+}
+
+int fda_resample_open(struct fda_resampler *rs, int rate, int smooth, fda_block_cb cb, void *ctx) {
+#if !defined(__GNUC__)
+	if(kernel[0] == 0.0)
+		kernel_init();
+#endif
+	memset(rs, 0, sizeof(struct fda_resampler));
+	if(rate <= 0)
+		return 1;
+	rs->rate = rate;
+	rs->smooth = smooth;
+	rs->cb = cb;
+	rs->ctx = ctx;
+	return 0;
+}
+
+void fda_resample_close(struct fda_resampler *rs) {
+	fda_free(rs->hist);
+	rs->hist = NULL;
+	rs->cap = 0;
+}
+
+/**
+ * Input column 'c' at session index 'j', edges repeat the first and last samples
+ */
+static double input_at(const struct fda_resampler *rs, int c, long j) {
+	if(j < 0)
+		return rs->first[c];
+	if(j >= rs->base+rs->n)
+		return rs->last[c];
+	return rs->hist[(j-rs->base)*FDA_RESAMPLE_COLUMNS+c];
+}
+
+/**
+ * Compute output samples whose kernel window was received ('final' once
+ * the session is over) and hand over full blocks
+ */
+static int produce(struct fda_resampler *rs, int final) {
+	struct fda_block *out = &rs->out;
+	double centre, w, sum, acc[FDA_RESAMPLE_COLUMNS];
+	long j, lo, hi, received = rs->base+rs->n;
+	int c, retval;
+
+	for(;;) {
+		/* output k sits at input index k*in/out */
+		centre = (double)rs->next*rs->in_rate/rs->rate;
+		if(final ? centre > received-1 : centre+rs->width >= received)
+			break;
+		lo = (long)ceil(centre-rs->width);
+		hi = (long)floor(centre+rs->width);
+		sum = 0.0;
+		for(c = 0; c < FDA_RESAMPLE_COLUMNS; c++)
+			acc[c] = 0.0;
+		for(j = lo; j <= hi; j++) {
+			w = kernel_at((j-centre)*rs->scale);
+			sum += w;
+			for(c = 0; c < FDA_RESAMPLE_COLUMNS; c++)
+				acc[c] += w*input_at(rs, c, j);
+		}
+		/* unit gain at DC, also where the window is cut */
+		for(c = 0; c < FDA_RESAMPLE_COLUMNS; c++)
+			acc[c] /= sum;
+
+		out->ts[out->n] = (double)rs->next/rs->rate;
+		out->pressure[out->n] = (long)floor(acc[0]+0.5);
+		out->temperature[out->n] = (short)floor(acc[1]+0.5);
+		out->altitude[out->n] = acc[2];
+		out->smooth[out->n] = acc[3];
+		rs->next++;
+		if(++out->n == FDA_BLOCK_SIZE) {
+			if((retval = (*rs->cb)(rs->ctx, FDA_SAMPLES, out)))
+				return retval;
+			out->n = 0;
+		}
+	}
+	if(out->n > 0) {
+		retval = (*rs->cb)(rs->ctx, FDA_SAMPLES, out);
+		out->n = 0;
+		return retval;
+	}
+	return 0;
+}
+
+/**
+ * Append a decoded block to the history, dropping samples no output needs
+ */
+static int append(struct fda_resampler *rs, const struct fda_block *blk) {
+	long keep = (long)ceil((double)rs->next*rs->in_rate/rs->rate - rs->width);
+	double *h;
+	int i, drop;
+
+	drop = keep-rs->base;
+	if(drop > rs->n)
+		drop = rs->n;
+	if(drop > 0) {
+		memmove(rs->hist, rs->hist+drop*FDA_RESAMPLE_COLUMNS, (rs->n-drop)*FDA_RESAMPLE_COLUMNS*sizeof(double));
+		rs->n -= drop;
+		rs->base += drop;
+	}
+	if(rs->n+blk->n > rs->cap) {
+		int cap = rs->n+blk->n+FDA_BLOCK_SIZE;
+		h = (double *) fda_realloc(rs->hist, cap*FDA_RESAMPLE_COLUMNS*sizeof(double));
+		if(!h)
+			return -5;
+		rs->hist = h;
+		rs->cap = cap;
+	}
+	h = rs->hist+rs->n*FDA_RESAMPLE_COLUMNS;
+	for(i = 0; i < blk->n; i++, h += FDA_RESAMPLE_COLUMNS) {
+		h[0] = blk->pressure[i];
+		h[1] = blk->temperature[i];
+		h[2] = blk->altitude[i];
+		h[3] = rs->smooth ? blk->smooth[i] : blk->altitude[i];
+	}
+	if(rs->base == 0 && rs->n == 0 && blk->n > 0)
+		memcpy(rs->first, rs->hist, sizeof(rs->first));
+	rs->n += blk->n;
+	if(rs->n > 0)
+		memcpy(rs->last, rs->hist+(rs->n-1)*FDA_RESAMPLE_COLUMNS, sizeof(rs->last));
+	return 0;
+}
+
+int fda_resample_block(void *ctx, int event, struct fda_block *blk) {
+	struct fda_resampler *rs = (struct fda_resampler *)ctx;
+	struct fda_block *out = &rs->out;
+	int retval;
+
+	switch(event) {
+	case FDA_SESSION_START:
+		rs->in_rate = blk->freq;
+		/* decimating: low pass at the output Nyquist rate, wider kernel */
+		rs->scale = rs->rate < rs->in_rate ? FDA_RESAMPLE_CUTOFF*rs->rate/rs->in_rate : 1.0;
+		rs->width = FDA_RESAMPLE_ZEROS/rs->scale;
+		rs->base = 0;
+		rs->n = 0;
+		rs->next = 0;
+		out->session = blk->session;
+		out->freq = rs->rate;
+		out->closed = 0;
+		out->n = 0;
+		return (*rs->cb)(rs->ctx, event, out);
+	case FDA_SAMPLES:
+		if((retval = append(rs, blk)))
+			return retval;
+		return produce(rs, 0);
+	case FDA_SESSION_END:
+		if(rs->n > 0 && (retval = produce(rs, 1)))
+			return retval;
+		out->closed = blk->closed;
+		return (*rs->cb)(rs->ctx, event, out);
+	}
+	return 0;
+}
@@ -0,0 +1,359 @@
+/**
+ * fda-downloader - Simple reader for FlyDream Altimeter or Hobbyking Altimeter
+ *
+ * Copyright (C) 2017  OLopes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* fopencookie() */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fda-downloader.h"
+#include "fda-pipeline.h"
+
+#if defined(__unix__) && defined(__GLIBC__)
+
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+/*
+ * Protocol, one conversion per connection:
+ *   request:  "FDA1 <format> <imperial> <length> [delimiter]\n" + <length> raw bytes
+ *             format is 'fda', 'dlm' or 'ndjson', imperial is 0 or 1
+ *   response: "OK\n" + converted data, or "ERROR <reason>\n"
+ * The server closes the connection when the response is complete.
+ */
+#define FDA_SERVER_MAGIC "FDA1"
+#define FDA_SERVER_LINE 256
+#define FDA_SERVER_MAX_PAYLOAD (32*1024*1024)
+#define FDA_SERVER_OUT_BUF (64*1024)
+#define FDA_SERVER_BACKLOG 16
+/* seconds a client may stay silent while sending its request, or
+   without reading while its response is sent */
+#define FDA_SERVER_TIMEOUT 5
+/* larger buffers are given back after the request that needed them */
+#define FDA_SERVER_KEEP (1024*1024)
+
+struct server_worker {
+	pthread_t thread;
+	int listen_fd;
+	struct fda_filter filter, *filterp;
+	/* buffers are kept between requests */
+	unsigned char *data;
+	int capacity;
+	char obuf[FDA_SERVER_OUT_BUF];
+	/* converted data, sent once the conversion succeeded */
+	char *out;
+	size_t out_len, out_cap;
+	int served;
+};
+
+/**
+ * Read the request line into 'line'. Bytes received after it are left
+ * after its terminating '\0', their count goes to 'extra'.
+ */
+static int read_line(int fd, char *line, int size, int *extra) {
+	int n = 0, r;
+	char *end;
+	while(n < size-1) {
+		r = read(fd, line+n, size-1-n);
+		if(r == -1 && errno == EINTR)
+			continue;
+		if(r <= 0)
+			return -1;
+		end = memchr(line+n, '\n', r);
+		n += r;
+		if(end) {
+			*end = '\0';
+			*extra = n - (end-line) - 1;
+			return end-line;
+		}
+	}
+	return -1;
+}
+
+static int read_full(int fd, unsigned char *buf, int size) {
+	int n = 0, r;
+	while(n < size) {
+		r = read(fd, buf+n, size-n);
+		if(r == -1 && errno == EINTR)
+			continue;
+		if(r <= 0)
+			return -1;
+		n += r;
+	}
+	return n;
+}
+
+static int write_full(int fd, const char *buf, size_t size) {
+	size_t n = 0;
+	ssize_t w;
+	while(n < size) {
+		w = write(fd, buf+n, size-n);
+		if(w == -1 && errno == EINTR)
+			continue;
+		if(w <= 0)
+			return -1;
+		n += w;
+	}
+	return 0;
+}
+
+/**
+ * stdio cookie: append to the worker output buffer
+ */
+static ssize_t out_write(void *cookie, const char *buf, size_t size) {
+	struct server_worker *w = (struct server_worker *)cookie;
+	size_t cap;
+	char *p;
+	if(w->out_len+size > w->out_cap) {
+		for(cap = w->out_cap ? w->out_cap : FDA_SERVER_OUT_BUF; cap < w->out_len+size; cap *= 2)
+			;
+		p = (char *) fda_realloc(w->out, cap);
+		if(!p)
+			return 0;
+		w->out = p;
+		w->out_cap = cap;
+	}
+	memcpy(w->out+w->out_len, buf, size);
+	w->out_len += size;
+	return size;
+}
+
+static void send_error(int fd, const char *reason) {
+	char msg[FDA_SERVER_LINE];
+	struct timeval timeout;
+	int len = snprintf(msg, sizeof(msg), "ERROR %s\n", reason);
+	if(write(fd, msg, len) != len)
+		print_msg("Error sending error response: %s\n", reason);
+	/* discard the unread request, closing now would reset the connection
+	   before the client reads the answer */
+	shutdown(fd, SHUT_WR);
+	timeout.tv_sec = 1;
+	timeout.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	while(read(fd, msg, sizeof(msg)) > 0)
+		;
+	close(fd);
+}
+
+static void serve(struct server_worker *w, int fd) {
+	cookie_io_functions_t io = { NULL, &out_write, NULL, NULL };
+	char line[FDA_SERVER_LINE], magic[8], format[8];
+	const char *dlm;
+	const struct fda_units *units;
+	int imperial, length, pos = 0, n, extra, retval;
+	unsigned char *data;
+	FILE *out;
+
+	if((n = read_line(fd, line, sizeof(line), &extra)) < 0) {
+		send_error(fd, "bad request");
+		return;
+	}
+	if(sscanf(line, "%7s %7s %d %d%n", magic, format, &imperial, &length, &pos) != 4
+			|| strcmp(magic, FDA_SERVER_MAGIC)) {
+		send_error(fd, "bad request");
+		return;
+	}
+	if(strcmp(format, "fda") && strcmp(format, "dlm") && strcmp(format, "ndjson")) {
+		send_error(fd, "unknown format");
+		return;
+	}
+	if(length < FDA_HEADER_SIZE+FDA_SAMPLE_SIZE || length > FDA_SERVER_MAX_PAYLOAD) {
+		send_error(fd, "bad length");
+		return;
+	}
+	/* delimiter is the rest of the line */
+	dlm = line[pos] == ' ' && line[pos+1] ? line+pos+1 : ",";
+	units = imperial ? &fda_imperial_units : &fda_metric_units;
+
+	if(w->capacity < length) {
+		data = (unsigned char *) fda_realloc(w->data, length);
+		if(!data) {
+			send_error(fd, "out of memory");
+			return;
+		}
+		w->data = data;
+		w->capacity = length;
+	}
+	/* start of the payload came with the request line */
+	if(extra > length)
+		extra = length;
+	memcpy(w->data, line+n+1, extra);
+	if(read_full(fd, w->data+extra, length-extra) < 0) {
+		send_error(fd, "short payload");
+		return;
+	}
+	if(!fda_valid_header(w->data)) {
+		send_error(fd, "bad signature");
+		return;
+	}
+
+	/* converted first, errors can still be reported */
+	w->out_len = 0;
+	out = fopencookie(w, "w", io);
+	if(!out) {
+		send_error(fd, "internal error");
+		return;
+	}
+	setvbuf(out, w->obuf, _IOFBF, sizeof(w->obuf));
+	if(!strcmp(format, "fda"))
+		retval = fda_write_fda(out, w->data, length);
+	else if(!strcmp(format, "ndjson"))
+		retval = fda_write_ndjson(out, w->data, length, units, w->filterp);
+	else
+		retval = fda_write_dlm(out, w->data, length, dlm, units, w->filterp);
+	if(fclose(out) && !retval)
+		retval = -3;
+	if(retval) {
+		print_msg("Conversion failed (%d)\n", retval);
+		send_error(fd, "conversion failed");
+		return;
+	}
+	if(write_full(fd, "OK\n", 3) || write_full(fd, w->out, w->out_len))
+		print_msg("Error sending response\n");
+	close(fd);
+	w->served++;
+}
+
+/**
+ * Release buffers an unusually large request left behind, so every
+ * worker doesn't end up holding the largest one ever served
+ */
+static void trim_buffers(struct server_worker *w) {
+	if(w->out_cap > FDA_SERVER_KEEP) {
+		fda_free(w->out);
+		w->out = NULL;
+		w->out_cap = 0;
+	}
+	if(w->capacity > FDA_SERVER_KEEP) {
+		fda_free(w->data);
+		w->data = NULL;
+		w->capacity = 0;
+	}
+}
+
+static void *worker_main(void *arg) {
+	struct server_worker *w = (struct server_worker *)arg;
+	struct timeval timeout;
+	int fd;
+	while(1) {
+		fd = accept(w->listen_fd, NULL, NULL);
+		if(fd == -1) {
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			/* listening socket was shut down */
+			break;
+		}
+		/* idle clients mustn't hold a worker forever, reading or writing */
+		timeout.tv_sec = FDA_SERVER_TIMEOUT;
+		timeout.tv_usec = 0;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		serve(w, fd);
+		trim_buffers(w);
+	}
+	return NULL;
+}
+
+int fda_server_run(const char *path, int workers, const struct fda_filter *filter) {
+	struct sockaddr_un addr;
+	struct server_worker *pool;
+	sigset_t sigs;
+	int fd, i, sig, retval = 0;
+
+	if(strlen(path) >= sizeof(addr.sun_path)) {
+		print_msg("Socket path too long: %s\n", path);
+		return -1;
+	}
+	if(workers < 1)
+		workers = 1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd == -1) {
+		perror("Error creating socket");
+		return -2;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, FDA_SERVER_BACKLOG) == -1) {
+		perror("Error binding socket");
+		close(fd);
+		return -3;
+	}
+
+	/* signals are handled by the main thread only */
+	signal(SIGPIPE, SIG_IGN);
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	pool = (struct server_worker *) fda_calloc(workers, sizeof(struct server_worker));
+	if(!pool) {
+		print_msg("Not enough memory for %d workers\n", workers);
+		close(fd);
+		unlink(path);
+		return -4;
+	}
+	for(i = 0; i < workers; i++) {
+		pool[i].listen_fd = fd;
+		if(filter) {
+			pool[i].filter = *filter;
+			pool[i].filterp = &pool[i].filter;
+		}
+		if(pthread_create(&pool[i].thread, NULL, &worker_main, &pool[i])) {
+			print_msg("Error starting worker %d\n", i);
+			workers = i;
+			retval = -5;
+			break;
+		}
+	}
+	print_msg("Listening on %s with %d workers\n", path, workers);
+	flush_msgs();
+
+	if(!retval)
+		sigwait(&sigs, &sig);
+
+	/* wake up workers blocked in accept() */
+	shutdown(fd, SHUT_RDWR);
+	for(i = 0; i < workers; i++) {
+		pthread_join(pool[i].thread, NULL);
+		print_msg("Worker %d served %d requests\n", i, pool[i].served);
+		fda_free(pool[i].data);
+		fda_free(pool[i].out);
+	}
+	fda_free(pool);
+	close(fd);
+	unlink(path);
+	return retval;
+}
+
+#else
+
+int fda_server_run(const char *path, int workers, const struct fda_filter *filter) {
+	print_msg("Server mode not supported on this platform\n");
+	return -1;
+}
+
+#endif
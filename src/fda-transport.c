@@ -0,0 +1,441 @@
+/**
+ * fda-downloader - Simple reader for FlyDream Altimeter or Hobbyking Altimeter
+ *
+ * Copyright (C) 2017  OLopes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* posix_openpt(), ptsname() */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "fda-downloader.h"
+
+#if defined(__unix__)
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <termios.h>
+#endif
+
+#define FDA_EMU_CMD_SIZE 7
+/* the serial backends give up on a read after half a second */
+#define FDA_EMU_MAX_WAIT_MS 500
+
+/* FILE TRANSPORT: raw dump handed out as it is, whatever the command */
+
+static int file_open(void **handle, const char *path) {
+	FILE *file;
+	file = fopen(path, "rb");
+	if(!file) {
+		perror("failed to open file");
+		return 1;
+	}
+	*handle = file;
+	return 0;
+}
+
+static int file_read(void *handle, unsigned char * buff, int n) {
+	FILE *file = (FILE*)handle;
+	int r;
+	r = fread(buff, sizeof(unsigned char), n, file);
+	if(r!=n && ferror(file)) {
+		/* error occurred */
+		return -1;
+	}
+	/* a dump doesn't grow, waiting for more data is pointless */
+	if(r == 0 && feof(file))
+		return -1;
+	return r;
+}
+
+static int file_write(void *handle, const unsigned char * buff, int n) {
+	return n;
+}
+
+static int file_flush(void *handle) {
+	return 0;
+}
+
+static int file_close(void *handle) {
+	fclose((FILE*)handle);
+	return 0;
+}
+
+/* ALTIMETER EMULATOR: answers commands from a recorded upload */
+
+struct fda_emu {
+	unsigned char *data;    /* recorded upload, header included */
+	int size;
+	unsigned char cmd[FDA_EMU_CMD_SIZE];
+	int n_cmd;
+	unsigned char ack[FDA_EMU_CMD_SIZE+1];
+	const unsigned char *out;   /* answer being sent */
+	int out_len, out_pos;
+	long baud;              /* line speed, 0 for no limit */
+#if defined(__unix__)
+	struct timespec start;  /* first byte of the answer */
+#endif
+};
+
+/**
+ * Load "file[,baud]"
+ */
+static int emu_load(struct fda_emu *e, const char *path) {
+	char name[FILENAME_MAX], *comma;
+	FILE *file;
+	long size;
+
+	memset(e, 0, sizeof(struct fda_emu));
+	snprintf(name, sizeof(name), "%s", path);
+	comma = strrchr(name, ',');
+	if(comma && comma[1] && strspn(comma+1, "0123456789") == strlen(comma+1)) {
+		*comma = '\0';
+		e->baud = atol(comma+1);
+	}
+	file = fopen(name, "rb");
+	if(!file) {
+		perror("failed to open file");
+		return 1;
+	}
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	rewind(file);
+	if(size < FDA_EMU_CMD_SIZE+1 || !(e->data = (unsigned char *) fda_malloc(size))
+			|| fread(e->data, 1, size, file) != size || e->data[0] != 0x07) {
+		print_msg("Not a recorded upload: %s\n", name);
+		fclose(file);
+		fda_free(e->data);
+		return 2;
+	}
+	fclose(file);
+	e->size = size;
+	return 0;
+}
+
+/**
+ * Command bytes from the host. The recorded command gets the recorded
+ * answer, anything else is just acknowledged.
+ */
+static void emu_command(struct fda_emu *e, const unsigned char *buff, int n) {
+	int k;
+	while(n > 0) {
+		k = FDA_EMU_CMD_SIZE-e->n_cmd < n ? FDA_EMU_CMD_SIZE-e->n_cmd : n;
+		memcpy(e->cmd+e->n_cmd, buff, k);
+		e->n_cmd += k;
+		buff += k;
+		n -= k;
+		if(e->n_cmd < FDA_EMU_CMD_SIZE)
+			break;
+		e->n_cmd = 0;
+		if(!memcmp(e->cmd, e->data+1, FDA_EMU_CMD_SIZE)) {
+			e->out = e->data;
+			e->out_len = e->size;
+		} else {
+			e->ack[0] = 0x07;
+			memcpy(e->ack+1, e->cmd, FDA_EMU_CMD_SIZE);
+			e->out = e->ack;
+			e->out_len = sizeof(e->ack);
+		}
+		e->out_pos = 0;
+#if defined(__unix__)
+		clock_gettime(CLOCK_MONOTONIC, &e->start);
+#endif
+	}
+}
+
+/**
+ * Number of answer bytes (at most 'n') that went through the line by now.
+ * Waits a little when none did.
+ */
+static int emu_avail(struct fda_emu *e, int n) {
+	int left = e->out_len-e->out_pos;
+	if(n > left)
+		n = left;
+#if defined(__unix__)
+	if(e->baud > 0 && n > 0) {
+		struct timespec now, wait;
+		long long elapsed, due, ms;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec-e->start.tv_sec)*1000000000LL + now.tv_nsec-e->start.tv_nsec;
+		/* 8n1: ten bits per byte */
+		due = elapsed*e->baud/10/1000000000LL - e->out_pos;
+		if(due < n) {
+			ms = (n-due)*10*1000/e->baud;
+			if(ms > FDA_EMU_MAX_WAIT_MS)
+				ms = FDA_EMU_MAX_WAIT_MS;
+			wait.tv_sec = ms/1000;
+			wait.tv_nsec = (ms%1000)*1000000L;
+			nanosleep(&wait, NULL);
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			elapsed = (now.tv_sec-e->start.tv_sec)*1000000000LL + now.tv_nsec-e->start.tv_nsec;
+			due = elapsed*e->baud/10/1000000000LL - e->out_pos;
+			if(due < n)
+				n = due > 0 ? due : 0;
+		}
+	}
+#endif
+	return n;
+}
+
+/* REPLAY TRANSPORT: emulator called directly */
+
+static int replay_open(void **handle, const char *path) {
+	struct fda_emu *e;
+	int retval;
+	e = (struct fda_emu *) fda_malloc(sizeof(struct fda_emu));
+	if(!e)
+		return 3;
+	if((retval = emu_load(e, path))) {
+		fda_free(e);
+		return retval;
+	}
+	*handle = e;
+	return 0;
+}
+
+static int replay_read(void *handle, unsigned char * buff, int n) {
+	struct fda_emu *e = (struct fda_emu *)handle;
+	n = emu_avail(e, n);
+	memcpy(buff, e->out+e->out_pos, n);
+	e->out_pos += n;
+	return n;
+}
+
+static int replay_write(void *handle, const unsigned char * buff, int n) {
+	emu_command((struct fda_emu *)handle, buff, n);
+	return n;
+}
+
+static int replay_close(void *handle) {
+	struct fda_emu *e = (struct fda_emu *)handle;
+	fda_free(e->data);
+	fda_free(e);
+	return 0;
+}
+
+#if defined(__unix__)
+
+/* PTY TRANSPORT: emulator behind a pseudo terminal, read through the serial backend */
+
+struct fda_pty {
+	struct fda_emu emu;
+	int master, slave;
+	void *serial;       /* slave end opened by the serial backend */
+	pthread_t thread;
+	int stop;
+};
+
+/**
+ * Emulator thread: serves the master end
+ */
+static void *pty_device(void *arg) {
+	struct fda_pty *p = (struct fda_pty *)arg;
+	struct fda_emu *e = &p->emu;
+	unsigned char buf[256];
+	struct pollfd pfd;
+	int r;
+
+	pfd.fd = p->master;
+	while(!__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE)) {
+		pfd.events = e->out_pos < e->out_len ? POLLOUT : POLLIN;
+		if(poll(&pfd, 1, 100) <= 0)
+			continue;
+		r = 0;
+		if(pfd.revents & POLLIN) {
+			r = read(p->master, buf, sizeof(buf));
+			if(r > 0)
+				emu_command(e, buf, r);
+		} else if(pfd.revents & POLLOUT) {
+			r = emu_avail(e, sizeof(buf));
+			if(r > 0 && (r = write(p->master, e->out+e->out_pos, r)) > 0)
+				e->out_pos += r;
+		}
+		if(r < 0 && errno != EAGAIN && errno != EINTR)
+			break;
+	}
+	return NULL;
+}
+
+static int pty_open(void **handle, const char *path) {
+	struct fda_pty *p;
+	struct termios tio;
+	const char *name;
+	int retval;
+
+	if(!fda_serial_transport) {
+		print_msg("pty: needs a serial port backend\n");
+		return 4;
+	}
+	p = (struct fda_pty *) fda_malloc(sizeof(struct fda_pty));
+	if(!p)
+		return 3;
+	if((retval = emu_load(&p->emu, path))) {
+		fda_free(p);
+		return retval;
+	}
+	p->stop = 0;
+	p->slave = -1;
+	p->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if(p->master < 0 || grantpt(p->master) || unlockpt(p->master) || !(name = ptsname(p->master))) {
+		perror("Error creating pseudo terminal");
+		retval = 5;
+		goto fail;
+	}
+	/* keep the slave open (and raw, like an USB adapter) for the whole session */
+	p->slave = open(name, O_RDWR | O_NOCTTY);
+	if(p->slave < 0 || tcgetattr(p->slave, &tio)) {
+		perror("Error opening pseudo terminal");
+		retval = 5;
+		goto fail;
+	}
+	cfmakeraw(&tio);
+	tcsetattr(p->slave, TCSANOW, &tio);
+	print_msg("Emulating %s on %s\n", path, name);
+	if((retval = (*fda_serial_transport->open)(&p->serial, name)))
+		goto fail;
+	if(pthread_create(&p->thread, NULL, &pty_device, p)) {
+		(*fda_serial_transport->close)(p->serial);
+		retval = 6;
+		goto fail;
+	}
+	*handle = p;
+	return 0;
+
+fail:
+	if(p->slave >= 0)
+		close(p->slave);
+	if(p->master >= 0)
+		close(p->master);
+	fda_free(p->emu.data);
+	fda_free(p);
+	return retval;
+}
+
+static int pty_read(void *handle, unsigned char * buff, int n) {
+	struct fda_pty *p = (struct fda_pty *)handle;
+	return (*fda_serial_transport->read)(p->serial, buff, n);
+}
+
+static int pty_write(void *handle, const unsigned char * buff, int n) {
+	struct fda_pty *p = (struct fda_pty *)handle;
+	return (*fda_serial_transport->write)(p->serial, buff, n);
+}
+
+static int pty_flush(void *handle) {
+	/* a pty has nothing in flight: flushing would only drop the command */
+	return 0;
+}
+
+static int pty_close(void *handle) {
+	struct fda_pty *p = (struct fda_pty *)handle;
+	int retval;
+	__atomic_store_n(&p->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(p->thread, NULL);
+	retval = (*fda_serial_transport->close)(p->serial);
+	close(p->slave);
+	close(p->master);
+	fda_free(p->emu.data);
+	fda_free(p);
+	return retval;
+}
+
+#endif
+
+static const struct fda_transport file_transport = {
+	"file", &file_open, &file_read, &file_write, &file_flush, &file_close
+};
+
+static const struct fda_transport replay_transport = {
+	"replay", &replay_open, &replay_read, &replay_write, &file_flush, &replay_close
+};
+
+#if defined(__unix__)
+static const struct fda_transport pty_transport = {
+	"pty", &pty_open, &pty_read, &pty_write, &pty_flush, &pty_close
+};
+#endif
+
+const struct fda_transport *fda_transport_find(const char *uri, const char **path) {
+	static const char *schemes[] = { "serial", "file", "replay", "pty", NULL };
+	const char *colon = strchr(uri, ':');
+	size_t len;
+	int i;
+
+	*path = uri;
+	/* one letter is a drive, not a scheme */
+	if(!colon || colon-uri < 2)
+		return fda_serial_transport ? fda_serial_transport : &file_transport;
+	len = colon-uri;
+	for(i = 0; schemes[i]; i++) {
+		if(strlen(schemes[i]) == len && !strncmp(schemes[i], uri, len))
+			break;
+	}
+	if(!schemes[i]) {
+		/* not a scheme at all, just a colon in the path */
+		for(i = 0; i < len && isalpha((unsigned char)uri[i]); i++)
+			;
+		return i < len ? (fda_serial_transport ? fda_serial_transport : &file_transport) : NULL;
+	}
+	*path = colon+1;
+	switch(i) {
+	case 0:
+		return fda_serial_transport;
+	case 1:
+		return &file_transport;
+	case 2:
+		return &replay_transport;
+	default:
+#if defined(__unix__)
+		return &pty_transport;
+#else
+		return NULL;
+#endif
+	}
+}
+
+/* API FUNCTIONS */
+
+int fda_init(struct fda_state* state) {
+	const char *path;
+	state->ops = fda_transport_find(state->tty_device, &path);
+	if(!state->ops) {
+		print_msg("Unsupported device: %s\n", state->tty_device);
+		return 2;
+	}
+	return (*state->ops->open)(&state->handle, path);
+}
+
+int fda_read(struct fda_state* state, unsigned char * buff, int n) {
+	return (*state->ops->read)(state->handle, buff, n);
+}
+
+int fda_write(struct fda_state* state, const unsigned char * buff, int n) {
+	return (*state->ops->write)(state->handle, buff, n);
+}
+
+int fda_flush(struct fda_state* state) {
+	return (*state->ops->flush)(state->handle);
+}
+
+int fda_close(struct fda_state* state) {
+	int retval = (*state->ops->close)(state->handle);
+	state->handle = NULL;
+	return retval;
+}
@@ -0,0 +1,297 @@
+/**
+ * fda-downloader - Simple reader for FlyDream Altimeter or Hobbyking Altimeter
+ *
+ * Copyright (C) 2017  OLopes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fda-downloader.h"
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <strings.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+/* list of converted files, kept in the watched directory */
+#define FDA_WATCH_STATE ".fda-watch.state"
+
+struct watch_entry {
+	char name[NAME_MAX+1];
+	long long size;
+	long long mtime;
+};
+
+struct watch_list {
+	struct watch_entry *e;
+	int n, cap;
+	int *slot;          /* open addressing hash of names, entry index + 1 */
+	unsigned int mask;  /* slot count - 1 */
+};
+
+static volatile sig_atomic_t stop_watch = 0;
+
+static void on_signal(int sig) {
+	stop_watch = 1;
+}
+
+/**
+ * Only .fda/.hka files. Hidden files are usually partial transfers.
+ */
+static int watched_name(const char *name) {
+	const char *ext = strrchr(name, '.');
+	if(name[0] == '.' || !ext)
+		return 0;
+	return !strcasecmp(ext, ".fda") || !strcasecmp(ext, ".hka");
+}
+
+/**
+ * FNV-1a hash of a file name
+ */
+static unsigned int hash_name(const char *name) {
+	unsigned int h = 2166136261u;
+	while(*name)
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+	return h;
+}
+
+static struct watch_entry *find_entry(struct watch_list *l, const char *name) {
+	unsigned int i;
+	if(!l->slot)
+		return NULL;
+	for(i = hash_name(name) & l->mask; l->slot[i]; i = (i+1) & l->mask)
+		if(!strcmp(l->e[l->slot[i]-1].name, name))
+			return &l->e[l->slot[i]-1];
+	return NULL;
+}
+
+/**
+ * Index entry 'idx' in the hash table
+ */
+static void hash_entry(struct watch_list *l, int idx) {
+	unsigned int i;
+	for(i = hash_name(l->e[idx].name) & l->mask; l->slot[i]; i = (i+1) & l->mask)
+		;
+	l->slot[i] = idx+1;
+}
+
+static struct watch_entry *add_entry(struct watch_list *l, const char *name) {
+	struct watch_entry *e;
+	int *slot, i, cap;
+	if(l->n == l->cap) {
+		cap = l->cap ? l->cap*2 : 64;
+		e = (struct watch_entry *) fda_realloc(l->e, cap*sizeof(struct watch_entry));
+		if(e)
+			l->e = e;
+		/* at most half full, so probes stay short */
+		slot = (int *) fda_calloc(cap*2, sizeof(int));
+		if(!e || !slot) {
+			print_msg("Out of memory tracking %s\n", name);
+			fda_free(slot);
+			return NULL;
+		}
+		l->cap = cap;
+		fda_free(l->slot);
+		l->slot = slot;
+		l->mask = cap*2-1;
+		for(i = 0; i < l->n; i++)
+			hash_entry(l, i);
+	}
+	e = &l->e[l->n++];
+	memset(e, 0, sizeof(struct watch_entry));
+	strncpy(e->name, name, NAME_MAX);
+	hash_entry(l, l->n-1);
+	return e;
+}
+
+static void clear_list(struct watch_list *l) {
+	if(l->slot)
+		memset(l->slot, 0, (l->mask+1)*sizeof(int));
+	l->n = 0;
+}
+
+static void free_list(struct watch_list *l) {
+	fda_free(l->e);
+	fda_free(l->slot);
+}
+
+static void load_state(struct watch_list *done, const char *file) {
+	char name[NAME_MAX+1], tmp[PATH_MAX];
+	long long size, mtime;
+	struct watch_entry *e;
+	int i, lines = 0;
+	FILE *f = fopen(file, "r");
+	if(!f)
+		return;
+	/* one line per conversion, later lines win */
+	while(fscanf(f, "%lld %lld %255[^\n]\n", &size, &mtime, name) == 3) {
+		lines++;
+		e = find_entry(done, name);
+		if(!e && !(e = add_entry(done, name)))
+			break;
+		e->size = size;
+		e->mtime = mtime;
+	}
+	fclose(f);
+	print_msg("%d converted files in %s\n", done->n, file);
+	if(lines == done->n)
+		return;
+
+	/* compact: one line per file, replaced atomically */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+	if(!(f = fopen(tmp, "w"))) {
+		perror("Error compacting watch state file");
+		return;
+	}
+	for(i = 0; i < done->n; i++)
+		fprintf(f, "%lld %lld %s\n", done->e[i].size, done->e[i].mtime, done->e[i].name);
+	if(fclose(f) || rename(tmp, file)) {
+		perror("Error compacting watch state file");
+		unlink(tmp);
+	}
+}
+
+static void queue_file(struct watch_list *queue, const char *name) {
+	if(watched_name(name) && !find_entry(queue, name))
+		add_entry(queue, name);
+}
+
+/**
+ * Convert queued files that were not converted in their current version
+ */
+static int process_queue(const char *dir, struct watch_list *queue, struct watch_list *done,
+		FILE *log, fda_device_cb cb, void *ctx) {
+	char path[PATH_MAX];
+	struct watch_entry *e;
+	struct stat st;
+	int i, retval;
+
+	for(i = 0; i < queue->n && !stop_watch; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, queue->e[i].name);
+		if(stat(path, &st) || !S_ISREG(st.st_mode))
+			continue;
+		e = find_entry(done, queue->e[i].name);
+		if(e && e->size == st.st_size && e->mtime == st.st_mtime)
+			continue;
+
+		retval = (*cb)(ctx, path);
+		if(retval > 0) {
+			/* incomplete, the next close/rename will queue it again */
+			print_msg("%s is not complete yet\n", path);
+			continue;
+		} else if(retval < 0) {
+			print_msg("Error converting %s\n", path);
+			continue;
+		}
+		if(!e && !(e = add_entry(done, queue->e[i].name)))
+			return -4;
+		e->size = st.st_size;
+		e->mtime = st.st_mtime;
+		fprintf(log, "%lld %lld %s\n", e->size, e->mtime, e->name);
+		fflush(log);
+	}
+	clear_list(queue);
+	return 0;
+}
+
+int fda_watch_run(const char *dir, fda_device_cb cb, void *ctx) {
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	char state_file[PATH_MAX];
+	struct watch_list queue, done;
+	const struct inotify_event *ev;
+	struct sigaction sa;
+	struct dirent *de;
+	DIR *d;
+	FILE *log;
+	int fd, len, retval = 0;
+	char *p;
+
+	memset(&queue, 0, sizeof(queue));
+	memset(&done, 0, sizeof(done));
+
+	/* no SA_RESTART: a signal must interrupt the blocking read */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = &on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	snprintf(state_file, sizeof(state_file), "%s/%s", dir, FDA_WATCH_STATE);
+	load_state(&done, state_file);
+	log = fopen(state_file, "a");
+	if(!log) {
+		perror("Error opening watch state file");
+		free_list(&done);
+		return -1;
+	}
+
+	/* watch first, then scan: files arriving in between are seen twice at most */
+	fd = inotify_init1(IN_CLOEXEC);
+	if(fd == -1 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+		perror("Error watching directory");
+		retval = -2;
+		goto out;
+	}
+	if((d = opendir(dir))) {
+		while((de = readdir(d)))
+			queue_file(&queue, de->d_name);
+		closedir(d);
+	}
+	print_msg("Watching %s, %d files to catch up\n", dir, queue.n);
+	flush_msgs();
+
+	while(!stop_watch && !retval) {
+		if((retval = process_queue(dir, &queue, &done, log, cb, ctx)))
+			break;
+		flush_msgs();
+		len = read(fd, buf, sizeof(buf));
+		if(len == -1) {
+			if(errno == EINTR)
+				continue;
+			perror("Error reading inotify events");
+			retval = -3;
+			break;
+		}
+		for(p = buf; p < buf+len; p += sizeof(struct inotify_event)+ev->len) {
+			ev = (const struct inotify_event *)p;
+			if(ev->len)
+				queue_file(&queue, ev->name);
+		}
+	}
+	print_msg("Watch stopped\n");
+
+out:
+	if(fd != -1)
+		close(fd);
+	fclose(log);
+	free_list(&queue);
+	free_list(&done);
+	return retval;
+}
+
+#else
+
+int fda_watch_run(const char *dir, fda_device_cb cb, void *ctx) {
+	print_msg("Watch mode not supported on this platform\n");
+	return -1;
+}
+
+#endif
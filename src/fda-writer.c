@@ -0,0 +1,423 @@
+/**
+ * fda-downloader - Simple reader for FlyDream Altimeter or Hobbyking Altimeter
+ *
+ * Copyright (C) 2017  OLopes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* fopencookie() */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fda-downloader.h"
+#include "fda-pipeline.h"
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define FDA_HAVE_IO_URING 1
+#endif
+#endif
+
+/* output is formatted into one buffer while the other one is written */
+#define FDA_WRITER_BUF_SIZE (1024*1024)
+
+#ifdef FDA_HAVE_IO_URING
+struct fda_uring {
+	int fd;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size, sqes_size;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+};
+#endif
+
+struct fda_writer {
+	int fd;
+	int mode;
+	int error;
+	off_t offset;       /* file offset of the next buffer */
+	char *buf[2];
+	size_t len[2];
+	off_t off[2];
+	int pending[2];     /* write in flight */
+	int cur;            /* buffer being filled */
+#ifdef FDA_HAVE_IO_URING
+	struct fda_uring ring;
+#endif
+	/* pwrite thread */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int queued;         /* buffer waiting for the thread or -1 */
+	int stop;
+};
+
+static int write_full(int fd, const char *buf, size_t len, off_t off) {
+	ssize_t w;
+	while(len > 0) {
+		w = pwrite(fd, buf, len, off);
+		if(w < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += w;
+		len -= w;
+		off += w;
+	}
+	return 0;
+}
+
+#ifdef FDA_HAVE_IO_URING
+
+static int uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+	return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static void uring_teardown(struct fda_uring *r) {
+	if(r->sqes)
+		munmap(r->sqes, r->sqes_size);
+	if(r->cq_ptr && r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_size);
+	if(r->sq_ptr)
+		munmap(r->sq_ptr, r->sq_size);
+	close(r->fd);
+	memset(r, 0, sizeof(struct fda_uring));
+}
+
+static int uring_setup(struct fda_uring *r) {
+	struct io_uring_params p;
+	void *ptr;
+
+	memset(r, 0, sizeof(struct fda_uring));
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, 4, &p);
+	if(r->fd < 0)
+		return -1;
+
+	r->sq_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	r->cq_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(r->cq_size > r->sq_size)
+			r->sq_size = r->cq_size;
+		r->cq_size = r->sq_size;
+	}
+	ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if(ptr == MAP_FAILED)
+		goto fail;
+	r->sq_ptr = ptr;
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ptr = r->sq_ptr;
+	} else {
+		ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if(ptr == MAP_FAILED)
+			goto fail;
+		r->cq_ptr = ptr;
+	}
+	r->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if(ptr == MAP_FAILED)
+		goto fail;
+	r->sqes = (struct io_uring_sqe *)ptr;
+
+	r->sq_tail = (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+	r->sq_mask = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+	r->cq_head = (unsigned *)((char *)r->cq_ptr + p.cq_off.head);
+	r->cq_tail = (unsigned *)((char *)r->cq_ptr + p.cq_off.tail);
+	r->cq_mask = (unsigned *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+	return 0;
+
+fail:
+	uring_teardown(r);
+	return -1;
+}
+
+static int uring_submit(struct fda_uring *r, int fd, const char *buf, size_t len, off_t off, int idx) {
+	unsigned tail = *r->sq_tail, i = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[i];
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = idx;
+	r->sq_array[i] = i;
+	__atomic_store_n(r->sq_tail, tail+1, __ATOMIC_RELEASE);
+	while(uring_enter(r->fd, 1, 0, 0) < 0) {
+		if(errno != EINTR)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * Reap one completion. Returns the write result and its buffer in 'idx'.
+ */
+static int uring_reap(struct fda_uring *r, int *idx) {
+	unsigned head;
+	struct io_uring_cqe *cqe;
+	int res;
+
+	head = *r->cq_head;
+	while(head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		if(uring_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+			return -errno;
+	}
+	cqe = &r->cqes[head & *r->cq_mask];
+	*idx = cqe->user_data;
+	res = cqe->res;
+	__atomic_store_n(r->cq_head, head+1, __ATOMIC_RELEASE);
+	return res;
+}
+
+/**
+ * Make sure the kernel knows IORING_OP_WRITE (5.6+): zero length write
+ */
+static int uring_probe(struct fda_writer *w) {
+	int idx = -1;
+	if(uring_submit(&w->ring, w->fd, w->buf[0], 0, 0, 0))
+		return -1;
+	return uring_reap(&w->ring, &idx);
+}
+
+#endif /* FDA_HAVE_IO_URING */
+
+static void *writer_thread(void *arg) {
+	struct fda_writer *w = (struct fda_writer *)arg;
+	int b, err;
+
+	pthread_mutex_lock(&w->lock);
+	while(1) {
+		while(w->queued < 0 && !w->stop)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if(w->queued < 0)
+			break;
+		b = w->queued;
+		w->queued = -1;
+		pthread_mutex_unlock(&w->lock);
+
+		err = write_full(w->fd, w->buf[b], w->len[b], w->off[b]);
+
+		pthread_mutex_lock(&w->lock);
+		if(err)
+			w->error = errno ? errno : EIO;
+		w->pending[b] = 0;
+		pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+/**
+ * Wait until buffer 'b' can be reused. Returns the first write error so
+ * far, read under the lock when a writer thread may set it.
+ */
+static int wait_buffer(struct fda_writer *w, int b) {
+	int err;
+#ifdef FDA_HAVE_IO_URING
+	int idx, res;
+	if(w->mode == FDA_IO_URING) {
+		while(w->pending[b]) {
+			idx = -1;
+			res = uring_reap(&w->ring, &idx);
+			if(idx < 0 || idx > 1) {
+				/* ring is broken, nothing more will complete */
+				w->error = res < 0 ? -res : EIO;
+				w->pending[0] = w->pending[1] = 0;
+				break;
+			}
+			if(res < 0) {
+				w->error = -res;
+			} else if((size_t)res < w->len[idx]
+					&& write_full(w->fd, w->buf[idx]+res, w->len[idx]-res, w->off[idx]+res)) {
+				/* finish short writes synchronously */
+				w->error = errno;
+			}
+			w->pending[idx] = 0;
+		}
+		return w->error;
+	}
+#endif
+	pthread_mutex_lock(&w->lock);
+	while(w->pending[b])
+		pthread_cond_wait(&w->cond, &w->lock);
+	err = w->error;
+	pthread_mutex_unlock(&w->lock);
+	return err;
+}
+
+/**
+ * Hand the current buffer to the kernel (or the writer thread) and
+ * switch to the other one
+ */
+static int submit_current(struct fda_writer *w) {
+	int b = w->cur, err;
+
+	w->off[b] = w->offset;
+	w->offset += w->len[b];
+	w->pending[b] = 1;
+#ifdef FDA_HAVE_IO_URING
+	if(w->mode == FDA_IO_URING) {
+		if(uring_submit(&w->ring, w->fd, w->buf[b], w->len[b], w->off[b], b)) {
+			w->error = errno;
+			w->pending[b] = 0;
+		}
+	} else
+#endif
+	{
+		pthread_mutex_lock(&w->lock);
+		while(w->queued >= 0)
+			pthread_cond_wait(&w->cond, &w->lock);
+		w->queued = b;
+		pthread_cond_broadcast(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	w->cur = b ^ 1;
+	err = wait_buffer(w, w->cur);
+	w->len[w->cur] = 0;
+	return err ? -1 : 0;
+}
+
+static ssize_t cookie_write(void *cookie, const char *data, size_t n) {
+	struct fda_writer *w = (struct fda_writer *)cookie;
+	size_t done = 0, k;
+
+	while(done < n) {
+		k = FDA_WRITER_BUF_SIZE - w->len[w->cur];
+		if(k > n-done)
+			k = n-done;
+		memcpy(w->buf[w->cur]+w->len[w->cur], data+done, k);
+		w->len[w->cur] += k;
+		done += k;
+		if(w->len[w->cur] == FDA_WRITER_BUF_SIZE && submit_current(w))
+			return 0;
+	}
+	return n;
+}
+
+static void writer_free(struct fda_writer *w) {
+	fda_free(w->buf[0]);
+	fda_free(w->buf[1]);
+	if(w->fd >= 0)
+		close(w->fd);
+	fda_free(w);
+}
+
+static int cookie_close(void *cookie) {
+	struct fda_writer *w = (struct fda_writer *)cookie;
+	int retval;
+
+	if(w->len[w->cur] > 0)
+		submit_current(w);
+	wait_buffer(w, 0);
+	wait_buffer(w, 1);
+#ifdef FDA_HAVE_IO_URING
+	if(w->mode == FDA_IO_URING)
+		uring_teardown(&w->ring);
+	else
+#endif
+	{
+		pthread_mutex_lock(&w->lock);
+		w->stop = 1;
+		pthread_cond_broadcast(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+		pthread_join(w->thread, NULL);
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->cond);
+	}
+
+	if(w->error)
+		print_msg("Error writing output: %s\n", strerror(w->error));
+	retval = w->error ? -1 : 0;
+	writer_free(w);
+	return retval;
+}
+
+FILE *fda_writer_open(const char *file, int mode) {
+	cookie_io_functions_t io = { NULL, &cookie_write, NULL, &cookie_close };
+	struct fda_writer *w;
+	FILE *fdf;
+
+	w = (struct fda_writer *) fda_calloc(1, sizeof(struct fda_writer));
+	if(!w)
+		return NULL;
+	w->queued = -1;
+	w->fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	w->buf[0] = (char *) fda_malloc(FDA_WRITER_BUF_SIZE);
+	w->buf[1] = (char *) fda_malloc(FDA_WRITER_BUF_SIZE);
+	if(w->fd < 0 || !w->buf[0] || !w->buf[1]) {
+		writer_free(w);
+		return NULL;
+	}
+
+	w->mode = FDA_IO_THREAD;
+#ifdef FDA_HAVE_IO_URING
+	if(mode == FDA_IO_AUTO || mode == FDA_IO_URING) {
+		if(!uring_setup(&w->ring)) {
+			if(!uring_probe(w))
+				w->mode = FDA_IO_URING;
+			else
+				uring_teardown(&w->ring);
+		}
+		if(w->mode != FDA_IO_URING)
+			print_msg("io_uring not available, writing from a thread\n");
+	}
+#endif
+	if(w->mode == FDA_IO_THREAD) {
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->cond, NULL);
+		if(pthread_create(&w->thread, NULL, &writer_thread, w)) {
+			pthread_mutex_destroy(&w->lock);
+			pthread_cond_destroy(&w->cond);
+			writer_free(w);
+			return NULL;
+		}
+	}
+
+	fdf = fopencookie(w, "w", io);
+	if(!fdf) {
+		cookie_close(w);
+		return NULL;
+	}
+	print_msg("Writing %s with %s\n", file, w->mode == FDA_IO_URING ? "io_uring" : "a writer thread");
+	return fdf;
+}
+
+#else
+
+FILE *fda_writer_open(const char *file, int mode) {
+	/* not available, caller falls back to stdio */
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,148 @@
+/**
+ * fda-downloader - Simple reader for FlyDream Altimeter or Hobbyking Altimeter
+ *
+ * Copyright (C) 2017  OLopes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "fda-downloader.h"
+#include "fda-pipeline.h"
+
+void print_msg(const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+}
+
+/**
+ * --fixed promises calc_altitude() within 1 cm, check the whole range
+ * the header comment of fda_altitude_cm() documents
+ */
+static int check_sweep(void) {
+	long p, cm, ref;
+	int fails = 0;
+	for(p = 30000; p <= 120000; p++) {
+		cm = fda_altitude_cm(p);
+		ref = (long)floor(calc_altitude(p, 0)*100.0 + 0.5);
+		if(labs(cm - ref) > 1 && fails++ < 10)
+			printf("altitude at %ld Pa: %ld cm, %ld cm expected\n", p, cm, ref);
+	}
+	printf("altitude sweep 30000..120000 Pa: %s\n", fails ? "FAILED" : "OK");
+	return fails ? 1 : 0;
+}
+
+/**
+ * Write a synthetic upload to 'file': one session per sample rate, each
+ * sweeping the pressure range of check_sweep() down and up again
+ */
+static int write_dump(const char *file) {
+	static const unsigned char signature[FDA_HEADER_SIZE] = {0x07, 0x0f, 0xda, 0x10, 0x00, 0xca, 0x00, 0x00};
+	unsigned char header[FDA_HEADER_SIZE+FDA_SAMPLE_SIZE], rec[FDA_SAMPLE_SIZE];
+	int rate, i, total = sizeof(header);
+	long p;
+	FILE *fdf = fopen(file, "wb");
+
+	if(!fdf) {
+		perror(file);
+		return 1;
+	}
+	memset(header, 0, sizeof(header));
+	memcpy(header, signature, FDA_HEADER_SIZE);
+	fwrite(header, 1, sizeof(header), fdf);
+	for(rate = 0; rate <= 3; rate++) {
+		rec[0] = rec[1] = rec[2] = 0;
+		rec[3] = rate;
+		fwrite(rec, 1, sizeof(rec), fdf);
+		for(i = 0; i < 2000; i++) {
+			p = i < 1000 ? 120000 - i*90 - rate : 30000 + (i-1000)*90 + rate*7;
+			rec[0] = 15 + i%20;
+			rec[1] = p >> 16;
+			rec[2] = p >> 8;
+			rec[3] = p;
+			fwrite(rec, 1, sizeof(rec), fdf);
+		}
+		fwrite("\xff\xff\xff\xff", 1, FDA_SAMPLE_SIZE, fdf);
+		total += (2000+2)*FDA_SAMPLE_SIZE;
+	}
+	fda_set_data_size(header, total);
+	rewind(fdf);
+	fwrite(header, 1, sizeof(header), fdf);
+	return fclose(fdf) ? 1 : 0;
+}
+
+/**
+ * Compare two delimited files field by field: same lines, text fields
+ * equal and numbers within 'tol'
+ */
+static int compare_dlm(const char *a, const char *b, double tol) {
+	char la[256], lb[256], *pa, *pb, *ea, *eb;
+	double max = 0, d;
+	int line = 0, fails = 0;
+	FILE *fa = fopen(a, "r"), *fb = fopen(b, "r");
+
+	if(!fa || !fb) {
+		perror(fa ? b : a);
+		return 1;
+	}
+	while(fgets(la, sizeof(la), fa)) {
+		line++;
+		if(!fgets(lb, sizeof(lb), fb)) {
+			printf("%s: only %d lines\n", b, line-1);
+			fails++;
+			break;
+		}
+		for(pa = la, pb = lb; *pa && *pb; pa = ea, pb = eb) {
+			d = fabs(strtod(pa, &ea) - strtod(pb, &eb));
+			if(ea == pa || eb == pb) {
+				/* not a number: must match */
+				if(*pa != *pb)
+					break;
+				ea = pa+1;
+				eb = pb+1;
+				continue;
+			}
+			if(d > max)
+				max = d;
+			if(d > tol)
+				break;
+		}
+		if((*pa || *pb) && fails++ < 10)
+			printf("line %d differs:\n%s%s", line, la, lb);
+	}
+	if(!fails && fgets(lb, sizeof(lb), fb)) {
+		printf("%s: more than %d lines\n", b, line);
+		fails++;
+	}
+	fclose(fa);
+	fclose(fb);
+	printf("%s vs %s: %d lines, max difference %.4f: %s\n", a, b, line, max, fails ? "FAILED" : "OK");
+	return fails ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+	if(argc == 2 && !strcmp(argv[1], "sweep"))
+		return check_sweep();
+	if(argc == 3 && !strcmp(argv[1], "dump"))
+		return write_dump(argv[2]);
+	if(argc == 5 && !strcmp(argv[1], "compare"))
+		return compare_dlm(argv[2], argv[3], atof(argv[4]));
+	fprintf(stderr, "Usage: %s sweep | dump <file> | compare <dlm> <dlm> <tolerance>\n", argv[0]);
+	return 2;
+}